@@ -8,14 +8,69 @@ enum DSType {
     ATOMICS_ARRAY = 2,
     LOCK_MAP = 3,
     TBB_MAP = 4,
+    STRIPED_COUNTER = 5,
+    LOCKFREE_MAP = 6,
+    RCU_MAP = 7,
 };
+constexpr int NUM_DS_TYPES = 7;
+
+inline const char* ds_name(DSType ds) {
+    switch (ds) {
+        case SHARDED_MAP: return "SHARDED_MAP";
+        case ATOMICS_ARRAY: return "ATOMICS_ARRAY";
+        case LOCK_MAP: return "LOCK_MAP";
+        case TBB_MAP: return "TBB_MAP";
+        case STRIPED_COUNTER: return "STRIPED_COUNTER";
+        case LOCKFREE_MAP: return "LOCKFREE_MAP";
+        case RCU_MAP: return "RCU_MAP";
+        default: return "UNKNOWN";
+    }
+}
+
+enum DistType {
+    DIST_UNIFORM = 0,
+    DIST_ZIPF = 1,
+    DIST_HOTSPOT = 2,
+    DIST_SEQUENTIAL = 3,
+    DIST_SHIFTING = 4,
+};
+
+inline const char* dist_name(DistType d) {
+    switch (d) {
+        case DIST_ZIPF: return "zipf";
+        case DIST_HOTSPOT: return "hotspot";
+        case DIST_SEQUENTIAL: return "sequential";
+        case DIST_SHIFTING: return "shifting";
+        default: return "uniform";
+    }
+}
+
 struct Settings {
     int num_requests {static_cast<int>(1e8)};
     int max_posts {static_cast<int>(1e6)};
-    int reads_per_write {50};
+    std::vector<int> reads_per_write {50}; // one run of the matrix per ratio
     int max_threads {1};
     int num_shards {128};
-    DSType ds {SHARDED_MAP};
+    int num_stripes {0}; // StripedCounter cells per hot post, 0 = hardware threads
+    int batch_size {1};  // requests per add_views/get_views call, 1 = one call per request
+    DistType dist {DIST_UNIFORM};
+    double zipf_theta {0.99};
+    double hot_keys_pct {1};  // hotspot / shifting: this share of the posts ...
+    int hot_ops_pct {90};     // ... gets this share of the requests
+    int shift_every {1000000}; // shifting: requests per hot set
+    std::string trace_file;    // replay these requests instead of generating
+    std::string save_trace;    // write the requests of this run here
+    int seed {1};              // request i is a function of (seed, i)
+    int gen_threads {0};       // threads generating the requests, 0 = hardware threads
+    bool stream {false};       // workers generate their requests as they go
+    std::vector<DSType> backends {SHARDED_MAP};
+    int trials {1};          // timed runs per backend x threads x ratio cell
+    int warmup {0};          // untimed runs before them
+    bool pin_threads {false};
+    bool perf {false};       // hardware counters per op, where the kernel allows them
+    std::string dispatch {"static"}; // static: calls on the backend's own type | virtual: through BaseCounter
+    std::string format {"text"}; // text | csv | json
+    std::string output;          // results go here instead of stdout
 };
 
 class ArgParser {
@@ -154,6 +209,17 @@ public:
 };
 
 // ---- small helpers for typed parsing & validation
+inline double to_double(const std::string& s, const char* flag) {
+    try {
+        size_t pos = 0;
+        double v = std::stod(s, &pos);
+        if (pos != s.size()) throw std::runtime_error("");
+        return v;
+    } catch (...) {
+        throw std::runtime_error(std::string("Invalid number for ") + flag + ": " + s);
+    }
+}
+
 inline int to_int(const std::string& s, const char* flag) {
     try {
         size_t pos = 0;
@@ -167,6 +233,18 @@ inline int to_int(const std::string& s, const char* flag) {
     }
 }
 
+// "1,2,6" -> {1, 2, 6}
+inline std::vector<int> to_int_list(const std::string& s, const char* flag) {
+    std::vector<int> out;
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        out.push_back(to_int(item, flag));
+    if (out.empty())
+        throw std::runtime_error(std::string("Empty list for ") + flag);
+    return out;
+}
+
 
 void load_cli_settings(Settings &settings, int argc, char* argv[]) {
     ArgParser p(argv[0]);
@@ -201,12 +279,13 @@ void load_cli_settings(Settings &settings, int argc, char* argv[]) {
                  });
 
     // --reads-per-write
-    p.add_option({"--reads-per-write"}, "INT",
-                 "Read ops per write op (>=1) (default: " + std::to_string(settings.reads_per_write) + ")",
+    p.add_option({"--reads-per-write"}, "INT[,INT...]",
+                 "Read ops per write op (>=1), a list runs each (default: " + std::to_string(settings.reads_per_write[0]) + ")",
                  [&](const std::string& v) {
-                     settings.reads_per_write = to_int(v, "--reads-per-write");
-                     if (settings.reads_per_write < 1)
-                         throw std::runtime_error("--reads-per-write must be >= 1");
+                     settings.reads_per_write = to_int_list(v, "--reads-per-write");
+                     for (int r : settings.reads_per_write)
+                         if (r < 1)
+                             throw std::runtime_error("--reads-per-write must be >= 1");
                  });
 
     // --num shards
@@ -218,17 +297,163 @@ void load_cli_settings(Settings &settings, int argc, char* argv[]) {
                          throw std::runtime_error("--shards >= 1");
                  });
 
-    // --num shards
-    p.add_option({"--ds"}, "INT",
-                 "Type of datastructure used, 1 = sharded, 2 = atomics, 3 = lock map, 4 = tbb_map, default " + std::to_string(settings.ds) + "(sharded) )",
+    // --stripes
+    p.add_option({"--stripes"}, "INT",
+                 "Cells per contended post for the striped counter, 0 = hardware threads (default: " + std::to_string(settings.num_stripes) + ")",
+                 [&](const std::string& v) {
+                     settings.num_stripes = to_int(v, "--stripes");
+                     if (settings.num_stripes < 0)
+                         throw std::runtime_error("--stripes >= 0");
+                 });
+
+    // --batch
+    p.add_option({"--batch"}, "INT",
+                 "Requests per batched add_views/get_views call, 1 = unbatched (default: " + std::to_string(settings.batch_size) + ")",
+                 [&](const std::string& v) {
+                     settings.batch_size = to_int(v, "--batch");
+                     if (settings.batch_size < 1)
+                         throw std::runtime_error("--batch >= 1");
+                 });
+
+    // --dist
+    p.add_option({"--dist"}, "NAME",
+                 "Post popularity: uniform, zipf, hotspot, sequential or shifting (default: " + std::string(dist_name(settings.dist)) + ")",
+                 [&](const std::string& v) {
+                     for (DistType d : {DIST_UNIFORM, DIST_ZIPF, DIST_HOTSPOT, DIST_SEQUENTIAL, DIST_SHIFTING}) {
+                         if (v == dist_name(d)) {
+                             settings.dist = d;
+                             return;
+                         }
+                     }
+                     throw std::runtime_error("--dist must be uniform, zipf, hotspot, sequential or shifting");
+                 });
+
+    p.add_option({"--zipf-theta"}, "NUM",
+                 "Zipf exponent (>0) (default: " + std::to_string(settings.zipf_theta) + ")",
+                 [&](const std::string& v) {
+                     settings.zipf_theta = to_double(v, "--zipf-theta");
+                     if (!(settings.zipf_theta > 0))
+                         throw std::runtime_error("--zipf-theta must be > 0");
+                 });
+
+    p.add_option({"--hot-keys"}, "PCT",
+                 "hotspot/shifting: percent of posts in the hot set (default: " + std::to_string(settings.hot_keys_pct) + ")",
                  [&](const std::string& v) {
-                     settings.ds = static_cast<DSType>(to_int(v, "--ds"));
-                     if (settings.ds < 1 || settings.ds > 4)
-                         throw std::runtime_error("--ds >= 1 and <= 4");
+                     settings.hot_keys_pct = to_double(v, "--hot-keys");
+                     if (!(settings.hot_keys_pct > 0 && settings.hot_keys_pct <= 100))
+                         throw std::runtime_error("--hot-keys must be in (0, 100]");
                  });
 
+    p.add_option({"--hot-ops"}, "PCT",
+                 "hotspot/shifting: percent of requests on the hot set (default: " + std::to_string(settings.hot_ops_pct) + ")",
+                 [&](const std::string& v) {
+                     settings.hot_ops_pct = to_int(v, "--hot-ops");
+                     if (settings.hot_ops_pct < 0 || settings.hot_ops_pct > 100)
+                         throw std::runtime_error("--hot-ops must be in [0, 100]");
+                 });
+
+    p.add_option({"--shift-every"}, "INT",
+                 "shifting: requests before the hot set moves on (default: " + std::to_string(settings.shift_every) + ")",
+                 [&](const std::string& v) {
+                     settings.shift_every = to_int(v, "--shift-every");
+                     if (settings.shift_every < 1)
+                         throw std::runtime_error("--shift-every >= 1");
+                 });
+
+    p.add_option({"--trace"}, "FILE",
+                 "Replay the requests of a binary trace instead of generating them",
+                 [&](const std::string& v) { settings.trace_file = v; });
+
+    p.add_option({"--save-trace"}, "FILE",
+                 "Write the run's requests as a binary trace",
+                 [&](const std::string& v) { settings.save_trace = v; });
+
+    p.add_option({"--seed"}, "INT",
+                 "Seed of the generated requests (default: " + std::to_string(settings.seed) + ")",
+                 [&](const std::string& v) { settings.seed = to_int(v, "--seed"); });
+
+    p.add_option({"--gen-threads"}, "INT",
+                 "Threads generating the requests, 0 = hardware threads (default: " + std::to_string(settings.gen_threads) + ")",
+                 [&](const std::string& v) {
+                     settings.gen_threads = to_int(v, "--gen-threads");
+                     if (settings.gen_threads < 0)
+                         throw std::runtime_error("--gen-threads >= 0");
+                 });
+
+    p.add_flag({"--stream"}, "Generate requests inside the workers as they run instead of up front (timed with the run)",
+               [&]() { settings.stream = true; });
+
+    // --ds
+    p.add_option({"--ds"}, "INT[,INT...]|all",
+                 "Type of datastructure used, 1 = sharded, 2 = atomics, 3 = lock map, 4 = tbb_map, 5 = striped, 6 = lock-free map, 7 = rcu map, a list runs each, default " + std::to_string(settings.backends[0]) + "(sharded) )",
+                 [&](const std::string& v) {
+                     settings.backends.clear();
+                     if (v == "all") {
+                         for (int ds = 1; ds <= NUM_DS_TYPES; ++ds) {
+#ifndef HAVE_TBB
+                             if (ds == TBB_MAP)
+                                 continue; // not built in; an explicit --ds 4 still says so
+#endif
+                             settings.backends.push_back(static_cast<DSType>(ds));
+                         }
+                         return;
+                     }
+                     for (int ds : to_int_list(v, "--ds")) {
+                         if (ds < 1 || ds > NUM_DS_TYPES)
+                             throw std::runtime_error("--ds >= 1 and <= " + std::to_string(NUM_DS_TYPES));
+                         settings.backends.push_back(static_cast<DSType>(ds));
+                     }
+                 });
+
+    p.add_option({"--trials"}, "INT",
+                 "Timed runs per backend, thread count and read ratio (default: " + std::to_string(settings.trials) + ")",
+                 [&](const std::string& v) {
+                     settings.trials = to_int(v, "--trials");
+                     if (settings.trials < 1)
+                         throw std::runtime_error("--trials >= 1");
+                 });
+
+    p.add_option({"--warmup"}, "INT",
+                 "Untimed runs before the trials (default: " + std::to_string(settings.warmup) + ")",
+                 [&](const std::string& v) {
+                     settings.warmup = to_int(v, "--warmup");
+                     if (settings.warmup < 0)
+                         throw std::runtime_error("--warmup >= 0");
+                 });
+
+    p.add_flag({"--pin"}, "Pin worker thread i to CPU i (mod the CPU count)",
+               [&]() { settings.pin_threads = true; });
+
+    p.add_flag({"--perf"}, "Count cycles, instructions, LLC/branch misses and HITM per op (perf_event_open)",
+               [&]() { settings.perf = true; });
+
+    p.add_option({"--dispatch"}, "static|virtual",
+                 "Call the backend through its own type, or through the BaseCounter vtable as a reference (default: " + settings.dispatch + ")",
+                 [&](const std::string& v) {
+                     if (v != "static" && v != "virtual")
+                         throw std::runtime_error("--dispatch must be static or virtual");
+                     settings.dispatch = v;
+                 });
+
+    p.add_option({"--format"}, "text|csv|json",
+                 "Result format (default: " + settings.format + ")",
+                 [&](const std::string& v) {
+                     if (v != "text" && v != "csv" && v != "json")
+                         throw std::runtime_error("--format must be text, csv or json");
+                     settings.format = v;
+                 });
+
+    p.add_option({"--output"}, "FILE",
+                 "Write the csv/json results to FILE instead of stdout",
+                 [&](const std::string& v) { settings.output = v; });
+
     try {
         p.parse(argc, argv);
+        if (settings.stream && (!settings.trace_file.empty() || !settings.save_trace.empty()))
+            throw std::runtime_error("--stream can not be combined with --trace or --save-trace");
+        // a trace holds one mix: every ratio would overwrite the saved one, and a replay ignores them
+        if (settings.reads_per_write.size() > 1 && (!settings.trace_file.empty() || !settings.save_trace.empty()))
+            throw std::runtime_error("a --reads-per-write list can not be combined with --trace or --save-trace");
     } catch (const std::exception& e) {
         std::cerr << e.what() << "\n\n" << p.usage();
         std::exit(1);
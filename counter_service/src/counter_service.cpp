@@ -9,7 +9,21 @@
 #include <chrono>
 #include <cassert>
 #include <memory>
+#include <bit>
+#include <limits>
+#include <span>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <barrier>
+#include <latch>
+#include <iomanip>
+#include <variant>
+#include <pthread.h>
+#include <sched.h>
 #include "arg_parser.h"
+#include "perf_counters.h"
 
 #ifdef HAVE_TBB
   #if __has_include(<oneapi/tbb/concurrent_hash_map.h>)
@@ -28,10 +42,21 @@ public:
     virtual void add_view(int post_id) = 0;
     virtual int get_views(int post_id) = 0;
 
+    // Batches: one view per id (an id may repeat) / out[i] = views of post_ids[i].
+    // Backends override these when a batch can share locks or hide memory latency.
+    virtual void add_views(std::span<const int> post_ids) {
+        for(int post_id: post_ids)
+            add_view(post_id);
+    }
+    virtual void get_views(std::span<const int> post_ids, std::span<int> out) {
+        for(size_t i = 0; i < post_ids.size(); i++)
+            out[i] = get_views(post_ids[i]);
+    }
+
     virtual ~BaseCounter() = default;
 };
 
-class LockMap: public BaseCounter {
+class LockMap final : public BaseCounter {
     std::unordered_map<int, int> counters_;
     std::shared_mutex mtx_;
 public:
@@ -56,10 +81,24 @@ public:
             return it->second;
         }
     }
+
+    void add_views(std::span<const int> post_ids) {
+        std::unique_lock<std::shared_mutex> lock(mtx_);
+        for(int post_id: post_ids)
+            counters_[post_id]++;
+    }
+
+    void get_views(std::span<const int> post_ids, std::span<int> out) {
+        std::unique_lock<std::shared_mutex> lock(mtx_);
+        for(size_t i = 0; i < post_ids.size(); i++) {
+            auto it = counters_.find(post_ids[i]);
+            out[i] = it == counters_.end() ? 0 : it->second;
+        }
+    }
 };
 
 
-class AtomicArray : public BaseCounter {
+class AtomicArray final : public BaseCounter {
     int max_id_;
     std::vector<std::atomic<int>> counters_; 
 public:
@@ -81,6 +120,122 @@ public:
         }
         return 0;
     }
+
+    // Random ids miss the cache on every counter; prefetching PREFETCH_AHEAD ids ahead keeps
+    // that many misses in flight instead of one.
+    static constexpr size_t PREFETCH_AHEAD = 16;
+
+    void add_views(std::span<const int> post_ids) {
+        for(size_t i = 0; i < post_ids.size(); i++) {
+            if(i + PREFETCH_AHEAD < post_ids.size() && post_ids[i + PREFETCH_AHEAD] < max_id_)
+                __builtin_prefetch(&counters_[post_ids[i + PREFETCH_AHEAD]], 1);
+            add_view(post_ids[i]);
+        }
+    }
+
+    void get_views(std::span<const int> post_ids, std::span<int> out) {
+        for(size_t i = 0; i < post_ids.size(); i++) {
+            if(i + PREFETCH_AHEAD < post_ids.size() && post_ids[i + PREFETCH_AHEAD] < max_id_)
+                __builtin_prefetch(&counters_[post_ids[i + PREFETCH_AHEAD]], 0);
+            out[i] = get_views(post_ids[i]);
+        }
+    }
+};
+
+
+// LongAdder-style counters: every post starts as a counter that add_view bumps with a CAS.
+// A failed CAS means another thread wrote the same post at the same time, and from then
+// on the post is a block of cache-line-padded cells, one per stripe, and each thread adds
+// to the cell of its own stripe. Hot posts stop bouncing a line between cores while cold
+// ones cost 8 bytes; get_views adds the cells up.
+class StripedCounter final : public BaseCounter {
+    struct alignas(64) Cell {
+        std::atomic<int> value {0};
+    };
+
+    int max_id_;
+    size_t stripe_mask_;
+    // count << 1 | 1 while uncontended, then the post's cells (new[] keeps the low bit clear)
+    std::vector<std::atomic<uintptr_t>> slots_;
+
+    // Threads take stripes round-robin in the order they first add a view.
+    size_t stripe() const {
+        static std::atomic<size_t> next_stripe {0};
+        thread_local size_t id = next_stripe.fetch_add(1, std::memory_order_relaxed);
+        return id & stripe_mask_;
+    }
+
+    static Cell* cells_of(uintptr_t slot) { return reinterpret_cast<Cell*>(slot); }
+
+    // Swaps the counter for cells that start from its count; slot is the value last seen.
+    Cell* inflate(std::atomic<uintptr_t> &post, uintptr_t slot) {
+        Cell* fresh = new Cell[stripe_mask_ + 1];
+        while(slot & 1) {
+            fresh[0].value.store(static_cast<int>(slot >> 1), std::memory_order_relaxed);
+            if(post.compare_exchange_weak(slot, reinterpret_cast<uintptr_t>(fresh), std::memory_order_release,
+                                          std::memory_order_acquire)) {
+                return fresh;
+            }
+        }
+        delete[] fresh; // another thread inflated it first
+        return cells_of(slot);
+    }
+
+public:
+    using BaseCounter::get_views; // the batch loop, hidden by get_views(int) otherwise
+
+    // num_stripes is rounded up to a power of two, 0 = one per hardware thread
+    explicit StripedCounter(size_t max_posts, int num_stripes = 0) : max_id_(max_posts + 1), slots_(max_id_) {
+        if(num_stripes <= 0) {
+            num_stripes = std::max(1u, std::thread::hardware_concurrency());
+        }
+        stripe_mask_ = std::bit_ceil(static_cast<unsigned int>(num_stripes)) - 1;
+        for(auto &slot: slots_)
+            slot.store(1, std::memory_order_relaxed);
+    }
+
+    ~StripedCounter() {
+        for(auto &slot: slots_) {
+            uintptr_t v = slot.load(std::memory_order_relaxed);
+            if(!(v & 1))
+                delete[] cells_of(v);
+        }
+    }
+
+    StripedCounter(const StripedCounter&) = delete;
+    StripedCounter& operator=(const StripedCounter&) = delete;
+
+    void add_view(int post_id) {
+        if(post_id >= max_id_) {
+            return;
+        }
+        auto &post = slots_[post_id];
+        uintptr_t slot = post.load(std::memory_order_acquire);
+        if(slot & 1) {
+            if(post.compare_exchange_strong(slot, slot + 2, std::memory_order_relaxed, std::memory_order_acquire)) {
+                return;
+            }
+            if(slot & 1)
+                slot = reinterpret_cast<uintptr_t>(inflate(post, slot));
+        }
+        cells_of(slot)[stripe()].value.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int get_views(int post_id) {
+        if(post_id >= max_id_) {
+            return 0;
+        }
+        uintptr_t slot = slots_[post_id].load(std::memory_order_acquire);
+        if(slot & 1) {
+            return static_cast<int>(slot >> 1);
+        }
+        const Cell* cells = cells_of(slot);
+        int sum = 0;
+        for(size_t i = 0; i <= stripe_mask_; i++) {
+            sum += cells[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
 };
 
 
@@ -88,7 +243,7 @@ bool isPowerOfTwo(unsigned int n) { // Use unsigned for popcount
     return (n > 0) && (std::popcount(n) == 1);
 }
 
-class ShardedMap : public BaseCounter {
+class ShardedMap final : public BaseCounter {
     struct alignas(64) Shard {
         std::unordered_map<int, int> counters_;
         mutable std::shared_mutex mtx_;
@@ -144,12 +299,403 @@ public:
             }
         }
     }
+
+    void add_views(std::span<const int> post_ids) {
+        if(!worth_grouping(post_ids.size())) {
+            BaseCounter::add_views(post_ids);
+            return;
+        }
+        const auto &sorted = partition(post_ids);
+        for(size_t i = 0; i < sorted.size();) {
+            uint32_t s = sorted[i] >> 32;
+            auto &shard = shards_[s];
+            std::unique_lock<std::shared_mutex> lock(shard.mtx_);
+            for(; i < sorted.size() && (sorted[i] >> 32) == s; i++)
+                shard.counters_[post_ids[static_cast<uint32_t>(sorted[i])]]++;
+        }
+    }
+
+    void get_views(std::span<const int> post_ids, std::span<int> out) {
+        if(!worth_grouping(post_ids.size())) {
+            BaseCounter::get_views(post_ids, out);
+            return;
+        }
+        const auto &sorted = partition(post_ids);
+        for(size_t i = 0; i < sorted.size();) {
+            uint32_t s = sorted[i] >> 32;
+            auto &shard = shards_[s];
+            std::shared_lock<std::shared_mutex> lock(shard.mtx_);
+            for(; i < sorted.size() && (sorted[i] >> 32) == s; i++) {
+                uint32_t idx = static_cast<uint32_t>(sorted[i]);
+                auto it = shard.counters_.find(post_ids[idx]);
+                out[idx] = it == shard.counters_.end() ? 0 : it->second;
+            }
+        }
+    }
+
+private:
+    // Per-thread scratch of one batch: its positions as shard << 32 | position, grouped by
+    // shard, so every touched shard is locked once.
+    struct Partition {
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> sorted;
+        std::vector<uint32_t> offsets;
+    };
+    static thread_local Partition part_;
+
+    // A batch smaller than the shard count rarely puts two ids in one shard, and grouping
+    // it costs more than the locks it saves.
+    bool worth_grouping(size_t batch) const { return batch >= static_cast<size_t>(num_shards_); }
+
+    // A counting sort, one radix pass over the shard bits.
+    const std::vector<uint64_t> &partition(std::span<const int> post_ids) const {
+        auto &keys = part_.keys;
+        keys.resize(post_ids.size());
+        for(size_t i = 0; i < post_ids.size(); i++)
+            keys[i] = static_cast<uint64_t>(get_shard_idx(post_ids[i])) << 32 | i;
+        auto &offsets = part_.offsets;
+        offsets.assign(num_shards_ + 1, 0);
+        for(uint64_t key: keys)
+            offsets[(key >> 32) + 1]++;
+        for(int s = 0; s < num_shards_; s++)
+            offsets[s + 1] += offsets[s];
+        part_.sorted.resize(keys.size());
+        for(uint64_t key: keys)
+            part_.sorted[offsets[key >> 32]++] = key;
+        return part_.sorted;
+    }
 };
 
+thread_local ShardedMap::Partition ShardedMap::part_;
+
+// Lock-free open addressing: a thread claims a slot for a post by CAS on its key and
+// counts with a CAS on its value, so neither path takes a lock, and readers only write
+// when they run into a move. Probing is linear from a multiplicative hash of the post id.
+// When a claim would fill the table past half, a table twice the size is chained behind it
+// and every thread that runs into the move copies chunks of slots until none are left.
+// Copying a slot seals it: an empty key becomes SEALED, a value gets its sign bit set.
+// An add never changes a sealed value (it is redone in the new table), so every thread
+// copying the slot reads the same count, and the new table only takes the first copy.
+// Copying a chunk twice is therefore harmless: a thread that finds the chunks handed out
+// but not all done copies the unfinished ones itself instead of waiting for their owners,
+// and a stalled thread holds nobody up. No view is lost or counted twice.
+// Old tables stay allocated until the map is destroyed, since a reader may still be in
+// one; they add up to less than the current one.
+class LockFreeMap final : public BaseCounter {
+    static constexpr int EMPTY = -1;
+    static constexpr int SEALED = -2;
+    static constexpr int SEALED_VALUE = std::numeric_limits<int>::min();
+    static constexpr size_t CHUNK = 4096;
+
+    struct Slot {
+        std::atomic<int> key {EMPTY};
+        std::atomic<int> value {0};
+    };
+
+    enum Result { DONE, MOVED, FULL };
+
+    struct Table {
+        size_t capacity;
+        int shift;
+        std::unique_ptr<Slot[]> slots;
+        alignas(64) std::atomic<size_t> claimed {0};
+        alignas(64) std::atomic<Table*> next {nullptr};
+        std::atomic<size_t> copy_cursor {0}; // chunks handed out
+        std::atomic<size_t> copy_done {0};   // chunks copied
+        std::unique_ptr<std::atomic<bool>[]> chunk_done;
+
+        explicit Table(size_t cap)
+            : capacity(cap), shift(64 - std::countr_zero(cap)), slots(new Slot[cap]),
+              chunk_done(new std::atomic<bool>[chunks()]) {}
+
+        size_t chunks() const { return (capacity + CHUNK - 1) / CHUNK; }
+
+        size_t home(int post_id) const {
+            return static_cast<size_t>((static_cast<uint64_t>(post_id) * 0x9E3779B97F4A7C15ULL) >> shift);
+        }
+
+        Result add(int post_id, int delta) {
+            size_t mask = capacity - 1;
+            size_t i = home(post_id);
+            for(size_t probes = 0; probes < capacity; probes++, i = (i + 1) & mask) {
+                Slot &slot = slots[i];
+                int key = slot.key.load(std::memory_order_acquire);
+                if(key == EMPTY) {
+                    if((claimed.load(std::memory_order_relaxed) + 1) * 2 > capacity)
+                        return FULL;
+                    if(slot.key.compare_exchange_strong(key, post_id, std::memory_order_acq_rel)) {
+                        claimed.fetch_add(1, std::memory_order_relaxed);
+                        key = post_id;
+                    }
+                }
+                if(key == SEALED)
+                    return MOVED;
+                if(key == post_id) {
+                    int value = slot.value.load(std::memory_order_relaxed);
+                    do {
+                        if(value < 0)
+                            return MOVED;
+                    } while(!slot.value.compare_exchange_weak(value, value + delta, std::memory_order_relaxed));
+                    return DONE;
+                }
+            }
+            return FULL;
+        }
+
+        // Moves a sealed count in while the move into this table is under way; until it is
+        // done only copiers write here, and each copier of a post brings the same count.
+        // Only the first lands, a late one finds the value no longer 0 (views only grow).
+        void copy(int post_id, int value) {
+            size_t mask = capacity - 1;
+            for(size_t i = home(post_id);; i = (i + 1) & mask) {
+                Slot &slot = slots[i];
+                int key = EMPTY;
+                if(slot.key.compare_exchange_strong(key, post_id, std::memory_order_acq_rel)) {
+                    claimed.fetch_add(1, std::memory_order_relaxed);
+                    key = post_id;
+                }
+                if(key == SEALED)
+                    return; // moved on already, so the first copy landed
+                if(key == post_id) {
+                    int zero = 0;
+                    slot.value.compare_exchange_strong(zero, value, std::memory_order_relaxed);
+                    return;
+                }
+            }
+        }
+
+        Result find(int post_id, int &value) const {
+            size_t mask = capacity - 1;
+            size_t i = home(post_id);
+            for(size_t probes = 0; probes < capacity; probes++, i = (i + 1) & mask) {
+                const Slot &slot = slots[i];
+                int key = slot.key.load(std::memory_order_acquire);
+                if(key == post_id) {
+                    value = slot.value.load(std::memory_order_relaxed);
+                    return value < 0 ? MOVED : DONE;
+                }
+                if(key == EMPTY) {
+                    value = 0;
+                    return DONE;
+                }
+                if(key == SEALED)
+                    return MOVED;
+            }
+            value = 0;
+            return DONE;
+        }
+    };
+
+    std::atomic<Table*> current_;
+    Table* first_;
+
+    static void copy_chunk(Table* from, Table* to, size_t chunk) {
+        size_t end = std::min(from->capacity, (chunk + 1) * CHUNK);
+        for(size_t i = chunk * CHUNK; i < end; i++) {
+            Slot &slot = from->slots[i];
+            int key = EMPTY;
+            if(slot.key.compare_exchange_strong(key, SEALED, std::memory_order_acq_rel) || key == SEALED)
+                continue;
+            int value = slot.value.fetch_or(SEALED_VALUE, std::memory_order_acq_rel) & ~SEALED_VALUE;
+            to->copy(key, value);
+        }
+    }
+
+    // Finishes the move out of t and returns the table that replaces it.
+    Table* help_move(Table* t) {
+        Table* next = t->next.load(std::memory_order_acquire);
+        if(next == nullptr) {
+            Table* bigger = new Table(t->capacity * 2);
+            if(t->next.compare_exchange_strong(next, bigger, std::memory_order_acq_rel)) {
+                next = bigger;
+            } else {
+                delete bigger; // another thread started the move
+            }
+        }
+        size_t chunks = t->chunks();
+        auto finish = [&](size_t chunk) {
+            copy_chunk(t, next, chunk);
+            if(!t->chunk_done[chunk].exchange(true, std::memory_order_acq_rel))
+                t->copy_done.fetch_add(1, std::memory_order_release);
+        };
+        for(size_t chunk; (chunk = t->copy_cursor.fetch_add(1, std::memory_order_relaxed)) < chunks;) {
+            finish(chunk);
+        }
+        // all handed out: copy what is still unfinished rather than wait for whoever took it
+        for(size_t chunk = 0; chunk < chunks && t->copy_done.load(std::memory_order_acquire) < chunks; chunk++) {
+            if(!t->chunk_done[chunk].load(std::memory_order_acquire))
+                finish(chunk);
+        }
+        Table* expected = t;
+        current_.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+        return next;
+    }
+
+public:
+    using BaseCounter::get_views; // the batch loop, hidden by get_views(int) otherwise
+
+    explicit LockFreeMap(int expected_posts = 0)
+        : current_(new Table(std::bit_ceil(std::max<size_t>(CHUNK, 2 * static_cast<size_t>(std::max(expected_posts, 0)) + 2)))),
+          first_(current_.load()) {}
+
+    ~LockFreeMap() {
+        for(Table* t = first_; t != nullptr;) {
+            Table* next = t->next.load(std::memory_order_relaxed);
+            delete t;
+            t = next;
+        }
+    }
+
+    LockFreeMap(const LockFreeMap&) = delete;
+    LockFreeMap& operator=(const LockFreeMap&) = delete;
+
+    void add_view(int post_id) {
+        if(post_id < 0) {
+            return; // negative ids are the slot markers
+        }
+        Table* t = current_.load(std::memory_order_acquire);
+        while(t->add(post_id, 1) != DONE) {
+            t = help_move(t);
+        }
+    }
+
+    int get_views(int post_id) {
+        if(post_id < 0) {
+            return 0;
+        }
+        Table* t = current_.load(std::memory_order_acquire);
+        int value = 0;
+        while(t->find(post_id, value) != DONE) {
+            t = help_move(t);
+        }
+        return value;
+    }
+};
+
+
+// Read-mostly map with invisible readers: a reader loads its shard's table pointer and the
+// slots it probes and never stores anything, so readers share every cache line they touch
+// and never bounce one between cores. Writers of a shard serialize on a mutex that sits on
+// its own cache line, away from what readers load. A new post is published by storing
+// its value and then, with release, its key; a probe that does not see the key yet reads
+// the post as 0, as if it came just before the insert. Updates to a post are plain stores
+// of the next count, so a reader sees the old or the new one.
+// Growth is read-copy-update: the writer copies the shard into a table twice the size and
+// publishes the pointer. Readers still in the old table finish there with a count that was
+// current a moment ago. Old tables are only freed with the map (nothing is ever deleted,
+// so they add up to less than the live ones); a map with deletes would need grace periods.
+class RcuMap final : public BaseCounter {
+    static constexpr int EMPTY = -1;
+
+    struct Slot {
+        std::atomic<int> key {EMPTY};
+        std::atomic<int> value {0};
+    };
+
+    struct Table {
+        size_t capacity;
+        int shift;
+        size_t size {0}; // writers only
+        std::unique_ptr<Slot[]> slots;
+
+        explicit Table(size_t cap) : capacity(cap), shift(64 - std::countr_zero(cap)), slots(new Slot[cap]) {}
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<Table*> table {nullptr};
+        alignas(64) std::mutex write_mtx;
+        std::vector<std::unique_ptr<Table>> tables; // the current one last
+    };
+
+    int shard_bits_;
+    std::vector<Shard> shards_;
+
+    static uint64_t hash(int post_id) { return static_cast<uint64_t>(post_id) * 0x9E3779B97F4A7C15ULL; }
+
+    // The top bits pick the shard, the ones below them the home slot.
+    Shard &shard_of(uint64_t h) { return shards_[shard_bits_ ? h >> (64 - shard_bits_) : 0]; }
+    size_t home(const Table *t, uint64_t h) const { return static_cast<size_t>((h << shard_bits_) >> t->shift); }
+
+    // Slot for post_id in t: its own, or the empty one where it would go.
+    Slot &probe(Table *t, int post_id, uint64_t h, std::memory_order order) {
+        size_t mask = t->capacity - 1;
+        for(size_t i = home(t, h);; i = (i + 1) & mask) {
+            int key = t->slots[i].key.load(order);
+            if(key == post_id || key == EMPTY)
+                return t->slots[i];
+        }
+    }
+
+    Table *grow(Shard &shard, Table *old) {
+        auto bigger = std::make_unique<Table>(old->capacity * 2);
+        for(size_t i = 0; i < old->capacity; i++) {
+            int key = old->slots[i].key.load(std::memory_order_relaxed);
+            if(key == EMPTY)
+                continue;
+            Slot &slot = probe(bigger.get(), key, hash(key), std::memory_order_relaxed);
+            slot.value.store(old->slots[i].value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            slot.key.store(key, std::memory_order_relaxed);
+        }
+        bigger->size = old->size;
+        Table *t = bigger.get();
+        shard.tables.push_back(std::move(bigger));
+        shard.table.store(t, std::memory_order_release); // readers see a filled table
+        return t;
+    }
+
+public:
+    using BaseCounter::get_views; // the batch loop, hidden by get_views(int) otherwise
+
+    RcuMap(int num_shards, int expected_posts) : shard_bits_(std::countr_zero(std::bit_ceil(static_cast<unsigned int>(std::max(num_shards, 1))))),
+                                                 shards_(size_t{1} << shard_bits_) {
+        size_t per_shard = static_cast<size_t>(std::max(expected_posts, 0)) / shards_.size() + 1;
+        size_t capacity = std::bit_ceil(std::max<size_t>(16, 2 * per_shard));
+        for(auto &shard: shards_) {
+            shard.tables.push_back(std::make_unique<Table>(capacity));
+            shard.table.store(shard.tables.back().get(), std::memory_order_relaxed);
+        }
+    }
+
+    void add_view(int post_id) {
+        if(post_id < 0) {
+            return; // EMPTY marks free slots
+        }
+        uint64_t h = hash(post_id);
+        Shard &shard = shard_of(h);
+        std::lock_guard<std::mutex> lock(shard.write_mtx);
+        Table *t = shard.table.load(std::memory_order_relaxed);
+        Slot *slot = &probe(t, post_id, h, std::memory_order_relaxed);
+        if(slot->key.load(std::memory_order_relaxed) == post_id) {
+            slot->value.store(slot->value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        if((t->size + 1) * 2 > t->capacity) {
+            t = grow(shard, t);
+            slot = &probe(t, post_id, h, std::memory_order_relaxed);
+        }
+        slot->value.store(1, std::memory_order_relaxed);
+        slot->key.store(post_id, std::memory_order_release);
+        t->size++;
+    }
+
+    int get_views(int post_id) {
+        if(post_id < 0) {
+            return 0;
+        }
+        uint64_t h = hash(post_id);
+        Table *t = shard_of(h).table.load(std::memory_order_acquire);
+        Slot &slot = probe(t, post_id, h, std::memory_order_acquire);
+        return slot.key.load(std::memory_order_relaxed) == post_id ? slot.value.load(std::memory_order_relaxed) : 0;
+    }
+};
+
+
 #ifdef HAVE_TBB
-class TbbMap : public BaseCounter {
+class TbbMap final : public BaseCounter {
     tbb::concurrent_hash_map<int,int> data_;
 public:
+    using BaseCounter::get_views; // the batch loop, hidden by get_views(int) otherwise
+
     explicit TbbMap() {
 
     }
@@ -176,133 +722,621 @@ enum OperationType {
     ADD_VIEW = 1
 };
 
+// One request in 4 bytes: the post id in the low 31 bits (ids are never negative) and
+// bit 31 set for ADD_VIEW. A trace file is an array of these.
 struct Request {
-    OperationType op_type {ADD_VIEW};
-    int post_id {0};
+    static constexpr uint32_t WRITE_BIT = 1u << 31;
+
+    uint32_t bits {WRITE_BIT};
+
+    Request() = default;
+    Request(OperationType op_type, int post_id)
+        : bits(static_cast<uint32_t>(post_id) | (op_type == ADD_VIEW ? WRITE_BIT : 0)) {}
+
+    OperationType op_type() const { return (bits & WRITE_BIT) ? ADD_VIEW : GET_VIEWS; }
+    int post_id() const { return static_cast<int>(bits & ~WRITE_BIT); }
 };
+static_assert(sizeof(Request) == 4);
+
+// SplitMix64 (Steele, Lea and Flood) as a UniformRandomBitGenerator: an add and a mix per
+// draw, against mt19937's 2.5 KB of state. for_request() starts request i's own stream
+// from a hash of (seed, i), so requests can be drawn in any order on any thread and still
+// come out the same.
+class SplitMix64 {
+    uint64_t state_;
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+public:
+    using result_type = uint64_t;
+
+    explicit SplitMix64(uint64_t state) : state_(state) {}
+
+    static SplitMix64 for_request(uint64_t seed, int64_t i) {
+        return SplitMix64(mix(seed ^ mix(static_cast<uint64_t>(i))));
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() { return mix(state_ += 0x9E3779B97F4A7C15ULL); }
+};
+
+// Zipf over ranks 1..n with any exponent > 0, by rejection-inversion (Hoermann and
+// Derflinger): O(1) setup and a few logs per draw, so n can be the whole post range.
+class ZipfSampler {
+    double n_, s_;
+    double h_integral_x1_, h_integral_n_, s_div_;
+
+    double h(double x) const { return std::exp(-s_ * std::log(x)); }
+    double h_integral(double x) const {
+        double log_x = std::log(x);
+        return helper2((1.0 - s_) * log_x) * log_x;
+    }
+    double h_integral_inverse(double x) const {
+        double t = std::max(-1.0, x * (1.0 - s_));
+        return std::exp(helper1(t) * x);
+    }
+    // log1p(x) / x and expm1(x) / x, with their series near 0
+    static double helper1(double x) {
+        return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+    static double helper2(double x) {
+        return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+    }
+
+public:
+    ZipfSampler(int64_t n, double s) : n_(static_cast<double>(n)), s_(s) {
+        h_integral_x1_ = h_integral(1.5) - 1.0;
+        h_integral_n_ = h_integral(n_ + 0.5);
+        s_div_ = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+    }
+
+    template <typename Engine>
+    int64_t sample(Engine &engine) const {
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        while(true) {
+            double u = h_integral_n_ + unit(engine) * (h_integral_x1_ - h_integral_n_);
+            double x = h_integral_inverse(u);
+            double k = std::clamp(std::floor(x + 0.5), 1.0, n_);
+            if(k - x <= s_div_ || u >= h_integral(k + 0.5) - h(k))
+                return static_cast<int64_t>(k);
+        }
+    }
+};
+
+// Which post the i-th request touches, for every --dist but trace (which has its own ids).
+// Hot posts are the low ids: zipf rank r is post r - 1, hotspot's hot set is the first
+// --hot-keys percent, and shifting moves that window one window further every --shift-every
+// requests. Sequential walks the ids in order.
+class KeyDistribution {
+    DistType type_;
+    int max_post_id_;
+    std::unique_ptr<ZipfSampler> zipf_;
+    int hot_keys_ {1};
+    int hot_ops_pct_ {0};
+    int shift_every_ {1};
 
-class RequestGenerator {
-    std::random_device rd_;
-    std::mt19937 engine_;
 public:
-    RequestGenerator(): engine_(rd_()) {}
-    std::vector<Request> gen_batch(int batch_size, int max_post_id, int reads_per_writes = 1) {
-        assert(reads_per_writes >= 1);
-
-        std::uniform_int_distribution<int> uniform_dist(0, max_post_id);
-
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        std::vector<Request> batch;
-        batch.reserve(batch_size);
-        for(int i = 0; i < batch_size; i++) {
-            int post_id = uniform_dist(engine_);
-            int op_prob = static_cast<int>(uniform_dist(engine_) % (reads_per_writes + 1));
-            OperationType op_type;
-            if(op_prob == 0) { // WRITE, low prob
-                op_type = ADD_VIEW;
-            } else { // READ
-                op_type = GET_VIEWS;
+    KeyDistribution(const Settings &settings)
+        : type_(settings.dist), max_post_id_(settings.max_posts) {
+        int64_t num_posts = static_cast<int64_t>(max_post_id_) + 1;
+        if(type_ == DIST_ZIPF)
+            zipf_ = std::make_unique<ZipfSampler>(num_posts, settings.zipf_theta);
+        hot_keys_ = static_cast<int>(std::clamp<int64_t>(std::llround(num_posts * settings.hot_keys_pct / 100.0), 1, num_posts));
+        hot_ops_pct_ = settings.hot_ops_pct;
+        shift_every_ = settings.shift_every;
+    }
+
+    template <typename Engine>
+    int next(Engine &engine, int64_t i) const {
+        switch(type_) {
+            case DIST_ZIPF:
+                return static_cast<int>(zipf_->sample(engine) - 1);
+            case DIST_SEQUENTIAL:
+                return static_cast<int>(i % (static_cast<int64_t>(max_post_id_) + 1));
+            case DIST_HOTSPOT:
+            case DIST_SHIFTING: {
+                int64_t num_posts = static_cast<int64_t>(max_post_id_) + 1;
+                int64_t offset = 0;
+                if(type_ == DIST_SHIFTING)
+                    offset = (i / shift_every_) * hot_keys_ % num_posts;
+                int64_t rank;
+                if(hot_keys_ == num_posts || std::uniform_int_distribution<int>(0, 99)(engine) < hot_ops_pct_)
+                    rank = std::uniform_int_distribution<int>(0, hot_keys_ - 1)(engine);
+                else
+                    rank = std::uniform_int_distribution<int64_t>(hot_keys_, num_posts - 1)(engine);
+                return static_cast<int>((rank + offset) % num_posts);
             }
-            batch.push_back({op_type, post_id});
+            default:
+                return std::uniform_int_distribution<int>(0, max_post_id_)(engine);
+        }
+    }
+};
+
+// The requests of one read ratio. Request i depends only on (--seed, i), so fill() can make
+// any slice on any thread: gen_batch splits the vector over --gen-threads, and --stream
+// workers fill their own slice a block at a time instead.
+class RequestGenerator {
+    const KeyDistribution &keys_;
+    int reads_per_write_;
+    uint64_t seed_;
+
+public:
+    RequestGenerator(const KeyDistribution &keys, int reads_per_write, uint64_t seed)
+        : keys_(keys), reads_per_write_(reads_per_write), seed_(seed) {
+        assert(reads_per_write >= 1);
+    }
+
+    Request at(int64_t i) const {
+        SplitMix64 engine = SplitMix64::for_request(seed_, i);
+        int post_id = keys_.next(engine, i);
+        // one in reads_per_write + 1 is a write
+        bool write = std::uniform_int_distribution<int>(0, reads_per_write_)(engine) == 0;
+        return {write ? ADD_VIEW : GET_VIEWS, post_id};
+    }
+
+    // Requests first .. first + out.size().
+    void fill(int64_t first, std::span<Request> out) const {
+        for(size_t k = 0; k < out.size(); k++) {
+            out[k] = at(first + static_cast<int64_t>(k));
+        }
+    }
+
+    std::vector<Request> gen_batch(int batch_size, int num_threads, std::ostream &log = std::cout) const {
+        if(num_threads < 1)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<Request> batch(batch_size);
+        const int per_thread = (batch_size - 1) / num_threads + 1;
+        std::vector<std::thread> threads;
+        for(int t = 0; t < num_threads; t++) {
+            int first = std::min(t * per_thread, batch_size);
+            int last = std::min(first + per_thread, batch_size);
+            threads.emplace_back([this, &batch, first, last]() {
+                fill(first, std::span<Request>(batch.data() + first, last - first));
+            });
+        }
+        for(auto &thread: threads) {
+            thread.join();
         }
 
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration_s = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
-        std::cout << "generation done in : " << std::chrono::duration<double>(duration_s).count() << " sec" << std::endl;
+        auto end_time = std::chrono::steady_clock::now();
+        log << "generation done in : " << std::chrono::duration<double>(end_time - start_time).count() << " sec ("
+            << num_threads << " threads, " << batch.size() * sizeof(Request) / 1e6 << " MB)" << std::endl;
 
         return batch;
     }
 };
 
+// Request traces: the Request words as they are in memory (little-endian here), one per
+// request. Errors throw std::runtime_error.
+std::vector<Request> load_trace(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if(!in)
+        throw std::runtime_error("Can not open trace " + path);
+    std::streamsize bytes = in.tellg();
+    if(bytes % sizeof(Request) != 0)
+        throw std::runtime_error("Trace " + path + " is not a whole number of 4-byte records");
+    std::vector<Request> cmds(bytes / sizeof(Request));
+    in.seekg(0);
+    if(!in.read(reinterpret_cast<char*>(cmds.data()), bytes))
+        throw std::runtime_error("Can not read trace " + path);
+    return cmds;
+}
+
+void save_trace(const std::string &path, const std::vector<Request> &cmds) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out.write(reinterpret_cast<const char*>(cmds.data()), cmds.size() * sizeof(Request)))
+        throw std::runtime_error("Can not write trace " + path);
+}
+
+// Backend is the counter's own (final) type, so every call below is direct and can be
+// inlined, or BaseCounter for the virtual reference path (--dispatch virtual).
+template <typename Backend>
 class WorkloadManager {
-    std::shared_ptr<BaseCounter> data_;
+    std::shared_ptr<Backend> data_;
+    int batch_size_;
+    // Sum of the views read. Once a backend is inlined, a read whose result goes nowhere is
+    // dead code to the compiler (the locked maps' lookups vanished), so every read lands here.
+    int64_t views_read_ {0};
+
+    // batch_size_ requests at a time: their writes go to add_views and their reads to get_views.
+    void run_batched(const std::vector<Request> &cmds, int start_cmd, int end_cmd) {
+        std::vector<int> reads, writes, views(batch_size_);
+        reads.reserve(batch_size_);
+        writes.reserve(batch_size_);
+        for(int batch_start = start_cmd; batch_start < end_cmd; batch_start += batch_size_) {
+            int batch_end = std::min(end_cmd, batch_start + batch_size_);
+            reads.clear();
+            writes.clear();
+            for(int cmd_id = batch_start; cmd_id < batch_end; cmd_id++) {
+                const auto &cmd = cmds[cmd_id];
+                (cmd.op_type() == GET_VIEWS ? reads : writes).push_back(cmd.post_id());
+            }
+            if(!writes.empty())
+                data_->add_views(writes);
+            if(!reads.empty())
+                data_->get_views(reads, std::span<int>(views.data(), reads.size()));
+            for(size_t i = 0; i < reads.size(); i++)
+                views_read_ += views[i];
+        }
+    }
 
 public:
-    WorkloadManager(std::shared_ptr<BaseCounter> data) : data_(data) {
+    WorkloadManager(std::shared_ptr<Backend> data, int batch_size = 1) : data_(data), batch_size_(batch_size) {
 
     }
     void run(const std::vector<Request> &cmds, int start_cmd, int end_cmd) {
+        if(batch_size_ > 1) {
+            run_batched(cmds, start_cmd, end_cmd);
+            return;
+        }
         for(int cmd_id = start_cmd; cmd_id < end_cmd; cmd_id++) {
             const auto &cmd = cmds[cmd_id];
-            if(cmd.op_type == GET_VIEWS)
-                data_->get_views(cmd.post_id);
-            if(cmd.op_type == ADD_VIEW)
-                data_->add_view(cmd.post_id);
+            if(cmd.op_type() == GET_VIEWS)
+                views_read_ += data_->get_views(cmd.post_id());
+            if(cmd.op_type() == ADD_VIEW)
+                data_->add_view(cmd.post_id());
         }
     }
-};
 
-int main(int argc, char* argv[]) {
-    Settings settings;
-    load_cli_settings(settings, argc, argv);
+    // --stream: generates start_cmd .. end_cmd a block at a time and runs each block while it
+    // is still in cache, so the requests never exist all at once. Blocks are whole batches.
+    void run(const RequestGenerator &gen, int start_cmd, int end_cmd) {
+        const int block_size = ((STREAM_BLOCK - 1) / batch_size_ + 1) * batch_size_;
+        std::vector<Request> block(block_size);
+        for(int first = start_cmd; first < end_cmd; first += block_size) {
+            int n = std::min(block_size, end_cmd - first);
+            gen.fill(first, std::span<Request>(block.data(), n));
+            run(block, 0, n);
+        }
+    }
+
+    int64_t views_read() const { return views_read_; }
 
-    std::shared_ptr<BaseCounter> post_data;
+    static constexpr int STREAM_BLOCK = 4096;
+};
 
-    switch(settings.ds) {
+// A backend by its own type; make_counter switches on DSType once, and std::visit hands
+// the typed pointer on to the templated trial.
+using Counter = std::variant<std::shared_ptr<ShardedMap>, std::shared_ptr<AtomicArray>, std::shared_ptr<LockMap>,
+                             std::shared_ptr<StripedCounter>, std::shared_ptr<LockFreeMap>, std::shared_ptr<RcuMap>
+#ifdef HAVE_TBB
+                             , std::shared_ptr<TbbMap>
+#endif
+                             >;
+
+Counter make_counter(DSType ds, const Settings &settings) {
+    switch(ds) {
         case SHARDED_MAP:
-            std::cout << "USING SHARDED MAP" << std::endl;
-            post_data = std::make_shared<ShardedMap>(settings.num_shards, settings.max_posts);
-            break;
+            return std::make_shared<ShardedMap>(settings.num_shards, settings.max_posts);
         case ATOMICS_ARRAY:
-            std::cout << "USING ATOMICS_ARRAY" << std::endl;
-            post_data = std::make_shared<AtomicArray>(settings.max_posts);
-            break;
+            return std::make_shared<AtomicArray>(settings.max_posts);
         case LOCK_MAP:
-            std::cout << "USING LOCK_MAP" << std::endl;
-            post_data = std::make_shared<LockMap>();
-            break;
+            return std::make_shared<LockMap>();
+        case STRIPED_COUNTER:
+            return std::make_shared<StripedCounter>(settings.max_posts, settings.num_stripes);
+        case LOCKFREE_MAP:
+            return std::make_shared<LockFreeMap>(settings.max_posts);
+        case RCU_MAP:
+            return std::make_shared<RcuMap>(settings.num_shards, settings.max_posts);
         case TBB_MAP:
-            std::cout << "USING TBB_MAP" << std::endl;
-            post_data = std::make_shared<TbbMap>();
-            break;
+#ifdef HAVE_TBB
+            return std::make_shared<TbbMap>();
+#else
+            throw std::runtime_error("TBB_MAP needs a build with TBB");
+#endif
         default:
-            break;
+            throw std::runtime_error("Unknown datastructure " + std::to_string(ds));
+    }
+}
+
+// CPUs this process may run on, in order; worker i is pinned to the i-th (mod their count).
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if(CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
     }
+    return cpus;
+}
 
-    RequestGenerator gen;
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
 
-    // gen input data
-    auto cmds = gen.gen_batch(settings.num_requests, settings.max_posts, settings.reads_per_write);
+// Runs all of cmds once on num_threads threads. The threads are created, pinned and handed
+// their slice before a start barrier, and only the time from the barrier until the last one
+// finishes is returned, so thread creation and joining stay out of the measurement.
+// The clock (and perf, if given) starts in the barrier's completion step, which runs before
+// any thread is released, and stops at the latest finish time a worker recorded.
+// With stream (--stream) cmds is empty and the workers generate their slices as they go.
+template <typename Backend>
+double run_trial(std::shared_ptr<Backend> data, const std::vector<Request> &cmds, const RequestGenerator *stream,
+                 int num_threads, const Settings &settings, const std::vector<int> &cpus, PerfCounters *perf = nullptr) {
+    const int total_work = stream ? settings.num_requests : cmds.size();
+    const int work_per_thread = (total_work - 1) / num_threads + 1;
+    using clock = std::chrono::steady_clock;
+    clock::time_point start_time;
+    auto on_start = [&]() noexcept {
+        if(perf)
+            perf->start();
+        start_time = clock::now();
+    };
+    std::barrier start(num_threads + 1, on_start);
+    std::latch done(num_threads);
+    std::vector<clock::time_point> end_times(num_threads);
+    std::atomic<int64_t> views_read {0}; // where the workers' reads end up, see WorkloadManager
 
-    const int total_work = cmds.size();
-    std::cout << "num shards: " << settings.num_shards << std::endl;
-    std::cout << "estimated num posts : " << settings.max_posts << std::endl;
-    std::cout << "   posts per shard : " << (settings.max_posts - 1)/settings.num_shards + 1 << std::endl;
-    std::cout << "   estimated data size : " << (settings.max_posts * sizeof(int)) / 1e6 << " MB" << std::endl;
-    std::cout << "reads to writes ratio: " << settings.reads_per_write << std::endl;
-    std::cout << "total requests (commands) : " << total_work << std::endl;
-    std::cout << "avg cmds per post : " << total_work / settings.max_posts << std::endl;
+    std::vector<std::thread> threads;
+    for(int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+        threads.emplace_back([&, thread_idx]() {
+            if(!cpus.empty())
+                pin_to_cpu(cpus[thread_idx % cpus.size()]);
+            int start_cmd = std::min(thread_idx * work_per_thread, total_work);
+            int end_cmd = std::min((thread_idx + 1) * work_per_thread, total_work);
+            WorkloadManager<Backend> mgr(data, settings.batch_size);
+            start.arrive_and_wait();
+            if(stream)
+                mgr.run(*stream, start_cmd, end_cmd);
+            else
+                mgr.run(cmds, start_cmd, end_cmd);
+            end_times[thread_idx] = clock::now();
+            views_read.fetch_add(mgr.views_read(), std::memory_order_relaxed);
+            done.count_down();
+        });
+    }
 
-    std::vector<double> thread_times;
-    for(int num_threads = 1; num_threads <= settings.max_threads; num_threads *= 2) {
-        std::vector<std::thread> threads;
+    start.arrive_and_wait();
+    done.wait();
+    if(perf)
+        perf->stop();
+    auto end_time = *std::max_element(end_times.begin(), end_times.end());
 
-        const int work_per_thread = (total_work - 1) / num_threads + 1;
-        auto start_time = std::chrono::high_resolution_clock::now();
+    for(auto &thread: threads) {
+        thread.join();
+    }
+    return std::chrono::duration<double>(end_time - start_time).count();
+}
 
-        for(int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
-            threads.emplace_back([&, thread_idx]() {
-                int start_cmd = thread_idx * work_per_thread;
-                int end_cmd = std::min((thread_idx + 1) * work_per_thread, total_work);
-                WorkloadManager mgr(post_data);
-                mgr.run(cmds, start_cmd, end_cmd);
-            });
+// One trial on counter through its own type, or through BaseCounter with --dispatch virtual.
+double run_trial(const Counter &counter, const std::vector<Request> &cmds, const RequestGenerator *stream,
+                 int num_threads, const Settings &settings, const std::vector<int> &cpus, PerfCounters *perf = nullptr) {
+    return std::visit([&](const auto &data) {
+        if(settings.dispatch == "virtual")
+            return run_trial(std::shared_ptr<BaseCounter>(data), cmds, stream, num_threads, settings, cpus, perf);
+        return run_trial(data, cmds, stream, num_threads, settings, cpus, perf);
+    }, counter);
+}
+
+// Throughput of the trials of one backend x threads x read ratio cell.
+struct CellResult {
+    DSType ds;
+    int threads;
+    int reads_per_write; // 0 for a replayed trace
+    double median {0}, stddev {0}, min {0}, max {0}; // ops/s
+    std::vector<PerfCounters::Reading> perf; // --perf: events per op over all trials
+
+    CellResult(DSType ds_, int threads_, int rpw, std::vector<double> ops_per_sec)
+        : ds(ds_), threads(threads_), reads_per_write(rpw) {
+        std::sort(ops_per_sec.begin(), ops_per_sec.end());
+        size_t n = ops_per_sec.size();
+        median = n % 2 ? ops_per_sec[n / 2] : (ops_per_sec[n / 2 - 1] + ops_per_sec[n / 2]) / 2;
+        min = ops_per_sec.front();
+        max = ops_per_sec.back();
+        if(n > 1) {
+            double mean = 0, sq = 0;
+            for(double v: ops_per_sec) mean += v / n;
+            for(double v: ops_per_sec) sq += (v - mean) * (v - mean);
+            stddev = std::sqrt(sq / (n - 1));
         }
+    }
+};
 
-        for(auto &thread: threads) {
-            thread.join();
+// Sums the counters of the cell's trials into per-op values.
+void add_perf(std::vector<PerfCounters::Reading> &sum, const std::vector<PerfCounters::Reading> &trial, double ops) {
+    if(sum.empty()) {
+        sum = trial;
+        for(auto &r: sum) r.value = 0;
+    }
+    for(size_t i = 0; i < sum.size(); i++) {
+        sum[i].valid = sum[i].valid && trial[i].valid;
+        sum[i].value += trial[i].value / ops;
+    }
+}
+
+void print_perf_text(std::ostream &out, const std::vector<PerfCounters::Reading> &perf) {
+    out << std::fixed << std::setprecision(2);
+    for(const auto &r: perf) {
+        out << " " << r.name << "/op=";
+        if(r.valid) out << r.value;
+        else out << "n/a";
+    }
+    if(perf.size() > 1 && perf[0].valid && perf[1].valid && perf[0].value > 0)
+        out << " ipc=" << perf[1].value / perf[0].value;
+    out << std::defaultfloat;
+}
+
+void print_csv(std::ostream &out, const Settings &settings, const std::vector<CellResult> &results) {
+    out << "ds,threads,reads_per_write,dist,batch,dispatch,trials,median_ops_s,stddev_ops_s,min_ops_s,max_ops_s";
+    if(settings.perf) {
+        for(const auto &name: PerfCounters::names())
+            out << "," << name << "_per_op";
+    }
+    out << "\n";
+    for(const auto &r: results) {
+        out << ds_name(r.ds) << "," << r.threads << "," << r.reads_per_write << "," << dist_name(settings.dist) << ","
+            << settings.batch_size << "," << settings.dispatch << "," << settings.trials << std::fixed << std::setprecision(0) << ","
+            << r.median << "," << r.stddev << "," << r.min << "," << r.max << std::setprecision(4);
+        if(settings.perf) {
+            for(size_t i = 0; i < PerfCounters::names().size(); i++) {
+                out << ",";
+                if(i < r.perf.size() && r.perf[i].valid) out << r.perf[i].value;
+            }
+        }
+        out << std::defaultfloat << "\n";
+    }
+}
+
+void print_json(std::ostream &out, const Settings &settings, int total_work, const std::vector<CellResult> &results) {
+    out << "{\"config\": {\"requests\": " << total_work << ", \"posts\": " << settings.max_posts
+        << ", \"shards\": " << settings.num_shards << ", \"dist\": \"" << dist_name(settings.dist)
+        << "\", \"batch\": " << settings.batch_size << ", \"dispatch\": \"" << settings.dispatch << "\", \"trials\": " << settings.trials
+        << ", \"warmup\": " << settings.warmup << ", \"pinned\": " << (settings.pin_threads ? "true" : "false")
+        << ", \"seed\": " << settings.seed << ", \"stream\": " << (settings.stream ? "true" : "false")
+        << "},\n\"results\": [";
+    out << std::fixed << std::setprecision(0);
+    for(size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        out << (i ? ",\n  " : "\n  ") << "{\"ds\": \"" << ds_name(r.ds) << "\", \"threads\": " << r.threads
+            << ", \"reads_per_write\": " << r.reads_per_write << ", \"median_ops_s\": " << r.median
+            << ", \"stddev_ops_s\": " << r.stddev << ", \"min_ops_s\": " << r.min << ", \"max_ops_s\": " << r.max;
+        if(settings.perf) {
+            out << ", \"perf_per_op\": {" << std::setprecision(4);
+            auto names = PerfCounters::names();
+            for(size_t k = 0; k < names.size(); k++) {
+                out << (k ? ", \"" : "\"") << names[k] << "\": ";
+                if(k < r.perf.size() && r.perf[k].valid) out << r.perf[k].value;
+                else out << "null";
+            }
+            out << "}" << std::setprecision(0);
+        }
+        out << "}";
+    }
+    out << std::defaultfloat << "\n]}\n";
+}
+
+int main(int argc, char* argv[]) {
+    Settings settings;
+    load_cli_settings(settings, argc, argv);
+
+    // progress goes to stderr when stdout carries csv/json
+    std::ostream &log = settings.format == "text" ? std::cout : std::cerr;
+    std::vector<int> cpus;
+    if(settings.pin_threads) {
+        cpus = allowed_cpus();
+        log << "pinning workers to " << cpus.size() << " cpus" << std::endl;
+    }
+    std::unique_ptr<PerfCounters> perf;
+    if(settings.perf) {
+        perf = std::make_unique<PerfCounters>();
+        if(!perf->any()) {
+            log << "perf counters unavailable (" << perf->error() << "), timing only" << std::endl;
+            perf.reset();
+        } else if(!perf->error().empty()) {
+            log << "some perf counters unavailable (" << perf->error() << ")" << std::endl;
+        }
+    }
+
+    std::vector<int> ratios = settings.reads_per_write;
+    if(!settings.trace_file.empty())
+        ratios = {0}; // the trace brings its own mix
+
+    std::vector<CellResult> results;
+    int total_work = 0;
+    for(int reads_per_write: ratios) {
+        // gen input data
+        std::vector<Request> cmds;
+        KeyDistribution keys(settings);
+        RequestGenerator gen(keys, std::max(reads_per_write, 1), static_cast<uint64_t>(settings.seed));
+        const RequestGenerator *stream = nullptr;
+        try {
+            if(!settings.trace_file.empty()) {
+                cmds = load_trace(settings.trace_file);
+                log << "replaying trace : " << settings.trace_file << std::endl;
+            } else if(settings.stream) {
+                stream = &gen;
+                log << "generating requests on the fly (seed " << settings.seed << ")" << std::endl;
+            } else {
+                cmds = gen.gen_batch(settings.num_requests, settings.gen_threads, log);
+            }
+            if(!settings.save_trace.empty())
+                save_trace(settings.save_trace, cmds);
+        } catch(const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        total_work = stream ? settings.num_requests : cmds.size();
+        log << "num shards: " << settings.num_shards << std::endl;
+        log << "estimated num posts : " << settings.max_posts << std::endl;
+        log << "   posts per shard : " << (settings.max_posts - 1)/settings.num_shards + 1 << std::endl;
+        log << "   estimated data size : " << (settings.max_posts * sizeof(int)) / 1e6 << " MB" << std::endl;
+        log << "reads to writes ratio: " << reads_per_write << std::endl;
+        log << "key distribution : " << dist_name(settings.dist) << std::endl;
+        log << "batch size : " << settings.batch_size << std::endl;
+        log << "dispatch : " << settings.dispatch << std::endl;
+        log << "total requests (commands) : " << total_work << std::endl;
+        log << "avg cmds per post : " << total_work / settings.max_posts << std::endl;
+        log << "trials : " << settings.trials << " (+" << settings.warmup << " warmup)" << std::endl;
+
+        for(DSType ds: settings.backends) {
+            log << "USING " << ds_name(ds) << std::endl;
+            double base_ms = 0;
+            for(int num_threads = 1; num_threads <= settings.max_threads; num_threads *= 2) {
+                std::vector<double> ops_per_sec;
+                std::vector<PerfCounters::Reading> perf_sum;
+                // every run, warm-up or timed, gets an empty backend: one that kept the posts
+                // of the run before would skip their inserts and any growth
+                try {
+                    for(int i = 0; i < settings.warmup; i++)
+                        run_trial(make_counter(ds, settings), cmds, stream, num_threads, settings, cpus);
+                    for(int i = 0; i < settings.trials; i++) {
+                        ops_per_sec.push_back(total_work / run_trial(make_counter(ds, settings), cmds, stream, num_threads,
+                                                                     settings, cpus, perf.get()));
+                        if(perf)
+                            add_perf(perf_sum, perf->read(), static_cast<double>(total_work) * settings.trials);
+                    }
+                } catch(const std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                    return 1;
+                }
+
+                CellResult r(ds, num_threads, reads_per_write, ops_per_sec);
+                r.perf = perf_sum;
+                double ms = 1e3 * total_work / r.median;
+                if(num_threads == 1)
+                    base_ms = ms;
+                log << num_threads << " threads) " << std::fixed << std::setprecision(0) << ms << " ms ("
+                    << std::defaultfloat << base_ms / ms << "x) " << std::setprecision(3) << r.median / 1e6 << " Mops/s";
+                if(settings.trials > 1)
+                    log << " +- " << std::setprecision(2) << 100 * r.stddev / r.median << "%";
+                if(!r.perf.empty())
+                    print_perf_text(log, r.perf);
+                log << std::defaultfloat << std::setprecision(6) << std::endl;
+                results.push_back(r);
+            }
         }
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-        thread_times.push_back(duration_ms.count());
     }
 
-    int num_threads = 1;
-    for(auto thread_time: thread_times) {
-        std::cout << num_threads << " threads) " << thread_time << " ms (" << thread_times[0]/thread_time << "x)" << std::endl;
-        num_threads *= 2;
+    if(settings.format != "text") {
+        std::ofstream file;
+        if(!settings.output.empty()) {
+            file.open(settings.output, std::ios::trunc);
+            if(!file) {
+                std::cerr << "Can not write " << settings.output << std::endl;
+                return 1;
+            }
+        }
+        std::ostream &out = settings.output.empty() ? std::cout : file;
+        if(settings.format == "csv")
+            print_csv(out, settings, results);
+        else
+            print_json(out, settings, total_work, results);
     }
 
     return 0;
-}
\ No newline at end of file
+}
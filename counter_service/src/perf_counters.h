@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware counters around a timed region (--perf), via perf_event_open.
+// Every event is opened disabled with inherit set, before the workers exist, so the
+// threads created afterwards count into it and their counts are folded in when they exit.
+// User space only, which is what perf_event_paranoid 2 (the usual container default) still
+// allows. An event that can not be opened (no PMU in a VM, seccomp, paranoid 3, unknown
+// raw event) is left out and reported as unavailable; the run goes on without it.
+// HITM (loads served by a modified line in another core's cache) has no generic event;
+// it is MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (raw 0x04d2, Intel Skylake and later) and only
+// tried on Intel CPUs.
+class PerfCounters {
+public:
+    struct Reading {
+        std::string name;
+        bool valid {false};
+        double value {0}; // scaled up when the kernel had to multiplex the counter
+    };
+
+private:
+    struct Event {
+        std::string name;
+        uint32_t type;
+        uint64_t config;
+        int fd {-1};
+    };
+
+    std::vector<Event> events_;
+    std::string error_; // why the first unavailable event failed
+
+    static bool intel_cpu() {
+        std::ifstream in("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.rfind("vendor_id", 0) == 0)
+                return line.find("GenuineIntel") != std::string::npos;
+        }
+        return false;
+    }
+
+    static int open_event(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+public:
+    PerfCounters() {
+        events_.push_back({"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES});
+        events_.push_back({"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS});
+        events_.push_back({"llc_misses", PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)});
+        events_.push_back({"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES});
+        events_.push_back({"hitm", PERF_TYPE_RAW, 0x04d2});
+
+        bool intel = intel_cpu();
+        for (auto& e : events_) {
+            if (e.type == PERF_TYPE_RAW && !intel) {
+                if (error_.empty()) error_ = e.name + ": not an Intel CPU";
+                continue;
+            }
+            e.fd = open_event(e.type, e.config);
+            if (e.fd < 0 && error_.empty())
+                error_ = e.name + ": " + std::strerror(errno);
+        }
+    }
+
+    ~PerfCounters() {
+        for (auto& e : events_)
+            if (e.fd >= 0) ::close(e.fd);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool any() const {
+        for (const auto& e : events_)
+            if (e.fd >= 0) return true;
+        return false;
+    }
+
+    // Empty when every event opened.
+    const std::string& error() const { return error_; }
+
+    static std::vector<std::string> names() {
+        return {"cycles", "instructions", "llc_misses", "branch_misses", "hitm"};
+    }
+
+    // Zeroes and starts every event. Threads started earlier count too, if they inherited it.
+    void start() {
+        for (auto& e : events_) {
+            if (e.fd < 0) continue;
+            ioctl(e.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(e.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop() {
+        for (auto& e : events_)
+            if (e.fd >= 0) ioctl(e.fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    // Counts since start(), including threads that have exited since. Read after joining.
+    std::vector<Reading> read() const {
+        std::vector<Reading> out;
+        for (const auto& e : events_) {
+            Reading r;
+            r.name = e.name;
+            uint64_t buf[3]; // value, time enabled, time running
+            if (e.fd >= 0 && ::read(e.fd, buf, sizeof(buf)) == static_cast<ssize_t>(sizeof(buf)) && buf[2] > 0) {
+                r.valid = true;
+                r.value = static_cast<double>(buf[0]) * static_cast<double>(buf[1]) / static_cast<double>(buf[2]);
+            }
+            out.push_back(r);
+        }
+        return out;
+    }
+};
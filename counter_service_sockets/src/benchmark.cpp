@@ -1,25 +1,52 @@
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "binary_protocol.h"
+#include "client.h"
+#include "histogram.h"
 
 struct Args {
     std::string host = "127.0.0.1";
     int port = 9000;
+    std::string endpoints; // --endpoints h:p,h:p,...: independent servers, keys spread by a hash ring
+    int vnodes = HashRing::DEFAULT_VNODES; // ring points per endpoint
+    std::vector<Endpoint> servers; // --endpoints, or --host/--port
     int seconds = 5;
     int keys = 10000;
     int write_pct = 50; // 0..100
     int seed = 42;
+    int threads = 1; // load threads, each with its own connections
+    int conns = 1; // active connections per thread
+    int idle = 0;  // extra connections that are opened and never used
+    int pipeline = 1; // commands sent back-to-back per connection before waiting for replies
+    int multi = 1; // keys per command, > 1 sends MINC/MGET instead of INC/GET
+    bool binary = false; // use the binary protocol instead of text commands
+    double rate = 0; // open loop: total commands per second on a fixed schedule, 0 = closed loop
+    std::string dist = "uniform"; // uniform | zipf | hotspot
+    double zipf_theta = 0.99;
+    double hot_keys_pct = 1; // hotspot: this share of the keys ...
+    int hot_ops_pct = 90;    // ... receives this share of the commands
+    int interval_ms = 1000; // throughput / latency reporting interval
+    std::string format = "text"; // text | csv | json
     bool verbose = false;
 };
 
@@ -29,111 +56,611 @@ Args parse_args(int argc, char** argv) {
         std::string s = argv[i];
         if (s == "--host" && i + 1 < argc) a.host = argv[++i];
         else if (s == "--port" && i + 1 < argc) a.port = std::stoi(argv[++i]);
+        else if (s == "--endpoints" && i + 1 < argc) a.endpoints = argv[++i];
+        else if (s == "--vnodes" && i + 1 < argc) a.vnodes = std::stoi(argv[++i]);
         else if (s == "--secs" && i + 1 < argc) a.seconds = std::stoi(argv[++i]);
         else if (s == "--keys" && i + 1 < argc) a.keys = std::stoi(argv[++i]);
         else if (s == "--writes" && i + 1 < argc) a.write_pct = std::stoi(argv[++i]);
         else if (s == "--seed" && i + 1 < argc) a.seed = std::stoi(argv[++i]);
+        else if (s == "--threads" && i + 1 < argc) a.threads = std::stoi(argv[++i]);
+        else if (s == "--conns" && i + 1 < argc) a.conns = std::stoi(argv[++i]);
+        else if (s == "--idle" && i + 1 < argc) a.idle = std::stoi(argv[++i]);
+        else if (s == "--pipeline" && i + 1 < argc) a.pipeline = std::stoi(argv[++i]);
+        else if (s == "--multi" && i + 1 < argc) a.multi = std::stoi(argv[++i]);
+        else if (s == "--binary") a.binary = true;
+        else if (s == "--rate" && i + 1 < argc) a.rate = std::stod(argv[++i]);
+        else if (s == "--dist" && i + 1 < argc) a.dist = argv[++i];
+        else if (s == "--zipf-theta" && i + 1 < argc) a.zipf_theta = std::stod(argv[++i]);
+        else if (s == "--hot-keys" && i + 1 < argc) a.hot_keys_pct = std::stod(argv[++i]);
+        else if (s == "--hot-ops" && i + 1 < argc) a.hot_ops_pct = std::stoi(argv[++i]);
+        else if (s == "--interval-ms" && i + 1 < argc) a.interval_ms = std::stoi(argv[++i]);
+        else if (s == "--format" && i + 1 < argc) a.format = argv[++i];
         else if (s == "--verbose") a.verbose = true;
         else if (s == "-h" || s == "--help") {
-            std::cout << "Usage: counter_client [--host H] [--port P] [--secs S] [--keys N] [--writes PCT] [--seed X]\n";
+            std::cout << "Usage: counter_client [--host H] [--port P] [--endpoints H:P,H:P,...] [--vnodes N]\n"
+                         "       [--secs S] [--keys N] [--writes PCT] [--seed X]\n"
+                         "       [--threads T] [--conns N (per thread)] [--idle N] [--pipeline N] [--multi N] [--binary]\n"
+                         "       [--rate OPS_PER_SEC (open loop)] [--dist uniform|zipf|hotspot] [--zipf-theta T]\n"
+                         "       [--hot-keys PCT] [--hot-ops PCT] [--interval-ms MS] [--format text|csv|json]\n";
             std::exit(0);
         }
     }
-    if (a.write_pct < 0) a.write_pct = 0; if (a.write_pct > 100) a.write_pct = 100;
+    if (a.write_pct < 0) a.write_pct = 0;
+    if (a.write_pct > 100) a.write_pct = 100;
+    if (a.keys < 1) a.keys = 1;
+    if (a.threads < 1) a.threads = 1;
+    if (a.conns < 1) a.conns = 1;
+    if (a.idle < 0) a.idle = 0;
+    if (a.pipeline < 1) a.pipeline = 1;
+    if (a.multi < 1) a.multi = 1;
+    if (a.rate < 0) a.rate = 0;
+    if (a.interval_ms < 1) a.interval_ms = 1;
+    if (a.vnodes < 1) a.vnodes = 1;
+    if (a.endpoints.empty()) {
+        a.servers.push_back(Endpoint{a.host, a.port});
+    } else {
+        try {
+            a.servers = parse_endpoints(a.endpoints);
+        } catch (const std::string& e) {
+            std::cerr << e << "\n";
+            std::exit(1);
+        }
+    }
+    if (a.multi > 1 && a.servers.size() > 1) {
+        std::cerr << "--multi needs a single endpoint, a batch would have to be split by the ring\n";
+        std::exit(1);
+    }
+    if (a.multi > 1 && a.binary) {
+        std::cerr << "--multi is only supported by the text protocol\n";
+        std::exit(1);
+    }
+    if (a.dist != "uniform" && a.dist != "zipf" && a.dist != "hotspot") {
+        std::cerr << "--dist must be uniform, zipf or hotspot\n";
+        std::exit(1);
+    }
+    if (a.dist == "zipf" && (a.zipf_theta <= 0 || a.zipf_theta >= 1)) {
+        std::cerr << "--zipf-theta must be in (0, 1)\n";
+        std::exit(1);
+    }
+    if (a.format != "text" && a.format != "csv" && a.format != "json") {
+        std::cerr << "--format must be text, csv or json\n";
+        std::exit(1);
+    }
     return a;
 }
 
-int connect_tcp(const std::string& host, int port) {
-    struct addrinfo hints{}; hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
-    struct addrinfo* res = nullptr;
-    int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
-    if (rc != 0) {
-        std::cerr << "getaddrinfo: " << gai_strerror(rc) << "\n"; return -1;
+void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
-    int fd = -1;
-    for (auto p = res; p != nullptr; p = p->ai_next) {
-        fd = ::socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (fd < 0) continue;
-        int one = 1;
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
-        if (::connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
-        ::close(fd); fd = -1;
-    }
-    freeaddrinfo(res);
-    if (fd < 0) perror("connect");
-    return fd;
 }
 
-bool write_all(int fd, const std::string& s) {
-    const char* p = s.data(); size_t left = s.size();
-    while (left > 0) {
-        ssize_t n = ::send(fd, p, left, 0);
-        if (n < 0) { if (errno == EINTR) continue; perror("send"); return false; }
-        left -= (size_t)n; p += n;
+// Key popularity over [0, n). Zipf uses the constant-time generator of Gray et al.
+// (the one in YCSB): O(n) setup, then one pow() per draw, rank 0 the most popular key.
+struct KeyDist {
+    enum class Kind { UNIFORM, ZIPF, HOTSPOT };
+    Kind kind = Kind::UNIFORM;
+    uint64_t n = 1;
+    double theta = 0, alpha = 0, zetan = 0, eta = 0, half_pow_theta = 0;
+    uint64_t hot_keys = 1;
+    int hot_ops_pct = 0;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+    explicit KeyDist(const Args& a) : n(static_cast<uint64_t>(a.keys)) {
+        if (a.dist == "zipf") {
+            kind = Kind::ZIPF;
+            theta = a.zipf_theta;
+            zetan = zeta(n, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1.0 - std::pow(2.0 / static_cast<double>(n), 1.0 - theta)) / (1.0 - zeta(2, theta) / zetan);
+            half_pow_theta = std::pow(0.5, theta);
+        } else if (a.dist == "hotspot") {
+            kind = Kind::HOTSPOT;
+            hot_keys = std::max<uint64_t>(1, std::min<uint64_t>(n, static_cast<uint64_t>(n * a.hot_keys_pct / 100.0)));
+            hot_ops_pct = a.hot_ops_pct;
+        }
+    }
+
+    template <typename Rng>
+    uint64_t next(Rng& rng) const {
+        switch (kind) {
+            case Kind::ZIPF: {
+                double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+                double uz = u * zetan;
+                if (uz < 1.0) return 0;
+                if (uz < 1.0 + half_pow_theta) return 1;
+                auto k = static_cast<uint64_t>(n * std::pow(eta * u - eta + 1.0, alpha));
+                return std::min(k, n - 1);
+            }
+            case Kind::HOTSPOT: {
+                bool hot = std::uniform_int_distribution<int>(0, 99)(rng) < hot_ops_pct;
+                if (hot || hot_keys == n) return std::uniform_int_distribution<uint64_t>(0, hot_keys - 1)(rng);
+                return std::uniform_int_distribution<uint64_t>(hot_keys, n - 1)(rng);
+            }
+            default:
+                return std::uniform_int_distribution<uint64_t>(0, n - 1)(rng);
+        }
+    }
+};
+
+// Random INC/GET commands over the configured key space.
+struct Workload {
+    std::mt19937 rng;
+    KeyDist keydist;
+    std::uniform_int_distribution<int> pct{0, 99};
+    int write_pct;
+    int multi;
+    bool binary;
+
+    Workload(const Args& a, const KeyDist& kd, int stream)
+        : rng(a.seed + stream), keydist(kd), write_pct(a.write_pct), multi(a.multi), binary(a.binary) {}
+
+    // key is set for single-key commands, for routing them.
+    std::string next(bool& is_write, std::string& key) {
+        if (multi > 1) return next_multi(is_write);
+        key = "key" + std::to_string(keydist.next(rng));
+        is_write = (pct(rng) < write_pct);
+        if (binary) {
+            std::string frame;
+            if (is_write) binproto::append_request(frame, binproto::OP_INC, key, 1);
+            else binproto::append_request(frame, binproto::OP_GET, key);
+            return frame;
+        }
+        if (is_write) return "INC " + key + " 1\n";
+        return "GET " + key + "\n";
     }
-    return true;
+
+    // One MINC/MGET carrying `multi` keys.
+    std::string next_multi(bool& is_write) {
+        is_write = (pct(rng) < write_pct);
+        std::string cmd = is_write ? "MINC" : "MGET";
+        for (int i = 0; i < multi; ++i) {
+            cmd += " key" + std::to_string(keydist.next(rng));
+            if (is_write) cmd += " 1";
+        }
+        return cmd + "\n";
+    }
+};
+
+struct Counts {
+    uint64_t ops = 0, reads = 0, writes = 0;
+    uint64_t sends = 0; // send calls that wrote data
+    uint64_t keys = 0;  // keys touched, differs from ops with --multi
+    uint64_t unfinished = 0; // sent but unanswered when the run ended
+    uint64_t busy = 0;       // shed by the server (--shed-ms), left out of the latencies
+    int keys_per_op = 1;
+
+    // Returns false for a BUSY reply.
+    bool record(bool is_write, const std::string& reply, bool binary) {
+        bool ok;
+        if (binary) {
+            auto status = binproto::read_reply(reply.data()).status;
+            if (status == binproto::ST_BUSY) { ++busy; return false; }
+            ok = status == binproto::ST_OK;
+        } else {
+            if (reply == "BUSY") { ++busy; return false; }
+            ok = reply.rfind(is_write ? "OK" : (keys_per_op > 1 ? "VALUES" : "VALUE "), 0) == 0;
+        }
+        if (ok) { if (is_write) ++writes; else ++reads; }
+        ++ops;
+        keys += keys_per_op;
+        return true;
+    }
+
+    void merge(const Counts& o) {
+        ops += o.ops; reads += o.reads; writes += o.writes;
+        sends += o.sends; keys += o.keys; unfinished += o.unfinished; busy += o.busy;
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+// One load thread with its own connections, command stream and latency histogram.
+// The histogram is single-writer, the reporter merges it while the thread runs.
+// Each of the thread's --conns clients is a group of one connection per endpoint:
+// fds[client * endpoints + endpoint].
+struct Worker {
+    std::vector<int> fds;
+    Workload wl;
+    Counts c;
+    std::vector<uint64_t> endpoint_ops; // replies per endpoint, read after the thread ends
+    Histogram latency; // ns, from the command's start time to its reply
+    std::atomic<bool> done{false};
+    std::thread thread;
+
+    Worker(const Args& a, const KeyDist& kd, int id) : wl(a, kd, id), endpoint_ops(a.servers.size(), 0) {
+        c.keys_per_op = a.multi;
+    }
+};
+
+// Closed loop (--rate 0): every client keeps --pipeline commands per endpoint in flight and
+// sends the next batch of --pipeline whenever that much room is free again (with a single
+// endpoint: when the last reply arrives); latency is measured from the send.
+// Open loop (--rate R): commands are due on a fixed schedule of R / threads per second,
+// spread round-robin over the thread's clients, whatever the replies do. Latency is
+// measured from the due time, not the send, so a stalled server is charged for the
+// commands it delayed instead of silently slowing the generator (coordinated omission).
+// Either way each command goes to the endpoint the ring picks for its key, and the
+// commands a batch routes to one endpoint leave in one send on that endpoint's connection.
+void run_worker(Worker& w, const Args& args, const HashRing& ring, Clock::time_point t0, Clock::time_point deadline) {
+    struct InFlight {
+        bool is_write;
+        Clock::time_point start;
+    };
+    struct ClientConn {
+        int fd;
+        size_t endpoint;
+        std::deque<InFlight> inflight; // oldest first
+        std::string rdbuf;
+        std::string outbuf;
+        size_t out_off = 0;
+        bool want_out = false; // EPOLLOUT registered
+    };
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) { perror("epoll_create1"); return; }
+
+    const size_t endpoints = ring.endpoints();
+    std::vector<ClientConn> conns;
+    conns.reserve(w.fds.size());
+    for (size_t i = 0; i < w.fds.size(); ++i) {
+        int fd = w.fds[i];
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        conns.push_back(ClientConn{fd, i % endpoints, {}, {}, {}, 0, false});
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    bool open_loop = args.rate > 0;
+    int timer_fd = -1;
+    const uint64_t TIMER = conns.size();
+    auto period = std::chrono::nanoseconds(open_loop ? static_cast<int64_t>(1e9 * args.threads / args.rate) : 0);
+    if (period.count() < 1) period = std::chrono::nanoseconds(1);
+    Clock::time_point next_due = t0;
+    const size_t clients = conns.size() / endpoints;
+    std::vector<size_t> client_inflight(clients, 0);
+    const size_t window = static_cast<size_t>(args.pipeline) * endpoints;
+    size_t next_client = 0;
+    if (open_loop) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = TIMER;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+    }
+
+    std::string key;
+    std::vector<char> touched(conns.size(), 0);
+    // Routes the client's next command and returns the connection it went to.
+    auto queue = [&](size_t client, Clock::time_point start) -> size_t {
+        bool is_write = false;
+        std::string cmd = w.wl.next(is_write, key);
+        size_t i = client * endpoints + ring.route(key);
+        ClientConn& cc = conns[i];
+        cc.outbuf += cmd;
+        cc.inflight.push_back(InFlight{is_write, start});
+        ++client_inflight[client];
+        touched[i] = 1;
+        return i;
+    };
+    // Sends what the socket takes now, the rest waits for EPOLLOUT.
+    auto flush = [&](ClientConn& cc, uint64_t idx) -> bool {
+        while (cc.out_off < cc.outbuf.size()) {
+            ssize_t n = ::send(cc.fd, cc.outbuf.data() + cc.out_off, cc.outbuf.size() - cc.out_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                perror("send");
+                return false;
+            }
+            cc.out_off += static_cast<size_t>(n);
+            ++w.c.sends;
+        }
+        if (cc.out_off == cc.outbuf.size()) {
+            cc.outbuf.clear();
+            cc.out_off = 0;
+        }
+        bool want = !cc.outbuf.empty();
+        if (want != cc.want_out) {
+            epoll_event ev{};
+            ev.events = want ? (EPOLLIN | EPOLLOUT) : static_cast<uint32_t>(EPOLLIN);
+            ev.data.u64 = idx;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, cc.fd, &ev);
+            cc.want_out = want;
+        }
+        return true;
+    };
+    // Sends what queue() added since the last call, one send per connection.
+    auto flush_touched = [&]() -> bool {
+        for (size_t i = 0; i < conns.size(); ++i) {
+            if (!touched[i]) continue;
+            touched[i] = 0;
+            if (!flush(conns[i], i)) return false;
+        }
+        return true;
+    };
+    // Open loop: queue every command that is due by now and re-arm the timer for the next one.
+    auto send_due = [&]() -> bool {
+        auto now = Clock::now();
+        while (next_due <= now && next_due < deadline) {
+            queue(next_client++ % clients, next_due);
+            next_due += period;
+        }
+        if (!flush_touched()) return false;
+        if (next_due < deadline) {
+            itimerspec its{};
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next_due.time_since_epoch()).count();
+            its.it_value.tv_sec = ns / 1000000000;
+            its.it_value.tv_nsec = ns % 1000000000;
+            timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+        }
+        return true;
+    };
+
+    bool ok = true;
+    if (open_loop) {
+        ok = send_due();
+    } else {
+        auto now = Clock::now();
+        for (size_t g = 0; g < clients; ++g)
+            while (client_inflight[g] < window) queue(g, now);
+        ok = flush_touched();
+    }
+
+    // After the deadline nothing new is sent; replies still in flight get a short grace period.
+    const auto drain_until = deadline + std::chrono::seconds(2);
+    std::vector<epoll_event> events(1024);
+    std::string line;
+    char tmp[64 * 1024];
+    while (ok) {
+        auto now = Clock::now();
+        bool stopping = now >= deadline;
+        if (stopping) {
+            bool idle = true;
+            for (const auto& cc : conns) idle = idle && cc.inflight.empty();
+            if (idle || now >= drain_until) break;
+        }
+
+        int timeout_ms = 100;
+        if (!stopping)
+            timeout_ms = std::min<int64_t>(timeout_ms, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
+        int n = epoll_wait(epfd, events.data(), (int)events.size(), timeout_ms);
+        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        for (int e = 0; e < n && ok; ++e) {
+            uint64_t idx = events[e].data.u64;
+            if (idx == TIMER) {
+                uint64_t expirations;
+                if (::read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("read(timerfd)");
+                ok = send_due();
+                continue;
+            }
+            ClientConn& cc = conns[idx];
+            if ((events[e].events & EPOLLOUT) && !flush(cc, idx)) { ok = false; break; }
+            if (!(events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) continue;
+
+            ssize_t r = ::recv(cc.fd, tmp, sizeof(tmp), 0);
+            if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (r <= 0) { std::cerr << "connection lost\n"; ok = false; break; }
+            cc.rdbuf.append(tmp, tmp + r);
+
+            auto received = Clock::now();
+            size_t client = idx / endpoints;
+            while (!cc.inflight.empty() && take_reply(cc.rdbuf, args.binary, line)) {
+                const InFlight& f = cc.inflight.front();
+                if (w.c.record(f.is_write, line, args.binary)) {
+                    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(received - f.start).count();
+                    w.latency.record(static_cast<uint64_t>(std::max<int64_t>(ns, 0)));
+                }
+                ++w.endpoint_ops[cc.endpoint];
+                cc.inflight.pop_front();
+                --client_inflight[client];
+            }
+            if (!open_loop && received < deadline && client_inflight[client] + args.pipeline <= window) {
+                for (int k = 0; k < args.pipeline; ++k) queue(client, received);
+                ok = flush_touched();
+            }
+        }
+    }
+
+    for (const auto& cc : conns) w.c.unfinished += cc.inflight.size();
+    if (timer_fd >= 0) ::close(timer_fd);
+    ::close(epfd);
 }
 
-bool read_line(int fd, std::string& out, std::string& buf) {
-    while (true) {
-        auto pos = buf.find('\n');
-        if (pos != std::string::npos) { out = buf.substr(0, pos); buf.erase(0, pos + 1); return true; }
-        char tmp[4096];
-        ssize_t n = ::recv(fd, tmp, sizeof(tmp), 0);
-        if (n == 0) return false;
-        if (n < 0) { if (errno == EINTR) continue; perror("recv"); return false; }
-        buf.append(tmp, tmp + n);
+// One line of the report: an interval, or the whole run.
+struct Row {
+    double t = 0;   // seconds since start at the end of the interval
+    double secs = 0;
+    uint64_t ops = 0;
+    double p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0; // us
+
+    Row(double t_, double secs_, const std::vector<uint64_t>& counts) : t(t_), secs(secs_) {
+        for (uint64_t n : counts) ops += n;
+        p50 = Histogram::percentile(counts, 0.5) / 1e3;
+        p90 = Histogram::percentile(counts, 0.9) / 1e3;
+        p99 = Histogram::percentile(counts, 0.99) / 1e3;
+        p999 = Histogram::percentile(counts, 0.999) / 1e3;
+        max = Histogram::percentile(counts, 1.0) / 1e3;
+    }
+    double qps() const { return secs > 0 ? ops / secs : 0.0; }
+};
+
+void print_row(std::ostream& os, const std::string& fmt, const Row& r, const char* label = nullptr) {
+    char buf[256];
+    if (fmt == "csv") {
+        std::string t = label != nullptr ? label : std::to_string(r.t);
+        snprintf(buf, sizeof(buf), "%s,%llu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f", t.c_str(),
+                 (unsigned long long)r.ops, r.qps(), r.p50, r.p90, r.p99, r.p999, r.max);
+    } else if (fmt == "json") {
+        snprintf(buf, sizeof(buf), "{\"t_s\": %.3f, \"ops\": %llu, \"qps\": %.0f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                 "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}", r.t,
+                 (unsigned long long)r.ops, r.qps(), r.p50, r.p90, r.p99, r.p999, r.max);
+    } else {
+        snprintf(buf, sizeof(buf), "t=%.1fs ops=%llu qps=%.0f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+                 r.t, (unsigned long long)r.ops, r.qps(), r.p50, r.p90, r.p99, r.p999, r.max);
     }
+    os << buf;
 }
 
 int main(int argc, char** argv) {
     auto args = parse_args(argc, argv);
-    int fd = connect_tcp(args.host, args.port);
-    if (fd < 0) return 1;
+    raise_fd_limit();
 
-    std::mt19937 rng(args.seed);
-    std::uniform_int_distribution<int> keydist(0, args.keys - 1);
-    std::uniform_int_distribution<int> pct(0, 99);
+    std::vector<int> idle_fds;
+    for (int i = 0; i < args.idle; ++i) {
+        const Endpoint& ep = args.servers[i % args.servers.size()];
+        int ifd = connect_tcp(ep.host, ep.port);
+        if (ifd < 0) { std::cerr << "opened only " << i << " idle connections\n"; break; }
+        idle_fds.push_back(ifd);
+    }
 
-    uint64_t ops = 0, reads = 0, writes = 0;
-    auto t0 = std::chrono::steady_clock::now();
-    std::string rdbuf, line;
+    KeyDist keydist(args);
+    HashRing ring(args.servers, args.vnodes);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int t = 0; t < args.threads; ++t) {
+        workers.push_back(std::make_unique<Worker>(args, keydist, t));
+        for (int i = 0; i < args.conns; ++i) {
+            for (const Endpoint& ep : args.servers) {
+                int cfd = connect_tcp(ep.host, ep.port);
+                if (cfd < 0) return 1;
+                if (args.binary && !write_all(cfd, std::string(1, static_cast<char>(binproto::MAGIC)))) return 1;
+                workers.back()->fds.push_back(cfd);
+            }
+        }
+    }
 
-    while (true) {
-        auto now = std::chrono::steady_clock::now();
-        double elapsed = std::chrono::duration<double>(now - t0).count();
-        if (elapsed >= args.seconds) break;
-
-        int k = keydist(rng);
-        std::string key = "key" + std::to_string(k);
-        bool do_write = (pct(rng) < args.write_pct);
-
-        std::string cmd;
-        if (do_write) { cmd = "INC " + key + " 1\n"; }
-        else { cmd = "GET " + key + "\n"; }
-
-        if (!write_all(fd, cmd)) break;
-        if (!read_line(fd, line, rdbuf)) break;
-        // Optional sanity: check prefix
-        if (do_write) { if (line.rfind("OK ", 0) == 0) ++writes; }
-        else { if (line.rfind("VALUE ", 0) == 0) ++reads; }
-        ++ops;
+    auto t0 = Clock::now();
+    auto deadline = t0 + std::chrono::seconds(args.seconds);
+    for (auto& w : workers) {
+        Worker* wp = w.get();
+        wp->thread = std::thread([wp, &args, &ring, t0, deadline] {
+            run_worker(*wp, args, ring, t0, deadline);
+            wp->done.store(true);
+        });
     }
 
-    auto t1 = std::chrono::steady_clock::now();
-    double secs = std::chrono::duration<double>(t1 - t0).count();
-    double qps = secs > 0 ? ops / secs : 0.0;
+    // Reporter: every interval, merge the workers' histograms and diff against the previous merge.
+    bool csv = args.format == "csv", json = args.format == "json";
+    if (csv) std::cout << "t_s,ops,qps,p50_us,p90_us,p99_us,p999_us,max_us\n";
+    if (json) std::cout << "{\"intervals\": [";
+    std::vector<uint64_t> prev(Histogram::BUCKETS, 0), total;
+    auto interval = std::chrono::milliseconds(args.interval_ms);
+    auto last = t0;
+    size_t rows = 0;
+    while (true) {
+        auto tick = std::min(last + interval, Clock::now() + interval);
+        bool all_done = true;
+        while (Clock::now() < tick) {
+            all_done = true;
+            for (auto& w : workers) all_done = all_done && w->done.load();
+            if (all_done) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(args.interval_ms, 10)));
+        }
+        auto now = Clock::now();
+        total.assign(Histogram::BUCKETS, 0);
+        for (auto& w : workers) w->latency.merge_into(total);
+        std::vector<uint64_t> diff(Histogram::BUCKETS);
+        for (int b = 0; b < Histogram::BUCKETS; ++b) diff[b] = total[b] - prev[b];
+        Row r(std::chrono::duration<double>(now - t0).count(), std::chrono::duration<double>(now - last).count(), diff);
+        if (r.ops > 0 || !all_done) {
+            if (csv || json || args.verbose) {
+                if (json) std::cout << (rows == 0 ? "\n  " : ",\n  ");
+                print_row(std::cout, args.format, r);
+                if (!json) std::cout << "\n";
+                std::cout.flush();
+                ++rows;
+            }
+        }
+        prev.swap(total);
+        last = now;
+        if (all_done) break;
+    }
+    for (auto& w : workers) w->thread.join();
+    auto t1 = Clock::now();
 
-    // Ask server for a quick stat & close
-    write_all(fd, std::string("STATS\n"));
-    if (read_line(fd, line, rdbuf)) {
-        std::cout << line << "\n"; // prints: STATS ops=... uptime_s=... keys=...
+    Counts c;
+    std::vector<uint64_t> endpoint_ops(args.servers.size(), 0);
+    for (auto& w : workers) {
+        c.merge(w->c);
+        for (size_t e = 0; e < endpoint_ops.size(); ++e) endpoint_ops[e] += w->endpoint_ops[e];
     }
-    write_all(fd, std::string("QUIT\n"));
+    // Nothing is sent after the deadline, so rates are over [t0, deadline]; the replies that
+    // arrive in the drain grace still count, the grace itself does not.
+    double secs = std::chrono::duration<double>(std::min(t1, deadline) - t0).count();
+    double qps = secs > 0 ? c.ops / secs : 0.0;
+    Row summary(secs, secs, prev);
 
-    ::close(fd);
+    for (auto& w : workers)
+        for (int cfd : w->fds) ::close(cfd);
+    for (int ifd : idle_fds) ::close(ifd);
+
+    // Ask every server for a quick stat & close. A fresh connection, since the
+    // benchmark ones may still have replies in flight. Machine readable formats send it to stderr.
+    for (const Endpoint& ep : args.servers) {
+        std::string rdbuf, line;
+        int fd = connect_tcp(ep.host, ep.port);
+        if (fd < 0) continue;
+        write_all(fd, std::string("STATS\n"));
+        if (read_reply(fd, line, rdbuf, false)) {
+            auto& os = args.format == "text" ? std::cout : std::cerr;
+            if (args.servers.size() > 1) os << ep.name() << " ";
+            os << line << "\n"; // prints: STATS post counters=...
+        }
+        write_all(fd, std::string("QUIT\n"));
+        ::close(fd);
+    }
 
-    std::cout << "Client run finished: ops=" << ops << ", reads=" << reads << ", writes=" << writes
-              << ", secs=" << secs << ", qps=" << qps << "\n";
+    const char* mode = args.rate > 0 ? "open" : "closed";
+    if (csv) {
+        print_row(std::cout, "csv", summary, "total");
+        std::cout << "\n";
+    } else if (json) {
+        char buf[512];
+        snprintf(buf, sizeof(buf), "\n],\n\"config\": {\"threads\": %d, \"conns\": %d, \"proto\": \"%s\", \"pipeline\": %d, "
+                 "\"multi\": %d, \"loop\": \"%s\", \"rate\": %.0f, \"dist\": \"%s\", \"keys\": %d, \"writes_pct\": %d},\n",
+                 args.threads, args.conns, args.binary ? "binary" : "text", args.pipeline, args.multi, mode, args.rate,
+                 args.dist.c_str(), args.keys, args.write_pct);
+        std::cout << buf << "\"summary\": ";
+        print_row(std::cout, "json", summary);
+        snprintf(buf, sizeof(buf), ",\n\"counts\": {\"ops\": %llu, \"reads\": %llu, \"writes\": %llu, \"sends\": %llu, "
+                 "\"keys\": %llu, \"unfinished\": %llu, \"busy\": %llu},\n", (unsigned long long)c.ops,
+                 (unsigned long long)c.reads, (unsigned long long)c.writes, (unsigned long long)c.sends,
+                 (unsigned long long)c.keys, (unsigned long long)c.unfinished, (unsigned long long)c.busy);
+        std::cout << buf << "\"endpoints\": [";
+        auto shares = ring.shares();
+        for (size_t e = 0; e < args.servers.size(); ++e) {
+            snprintf(buf, sizeof(buf), "%s\n  {\"endpoint\": \"%s\", \"ops\": %llu, \"ring_share\": %.4f}",
+                     e == 0 ? "" : ",", args.servers[e].name().c_str(), (unsigned long long)endpoint_ops[e], shares[e]);
+            std::cout << buf;
+        }
+        std::cout << "\n]\n}\n";
+    } else {
+        std::cout << "Client run finished: threads=" << args.threads << ", conns=" << args.threads * args.conns
+                  << ", endpoints=" << args.servers.size()
+                  << ", idle=" << idle_fds.size() << ", proto=" << (args.binary ? "binary" : "text")
+                  << ", loop=" << mode << ", dist=" << args.dist << ", pipeline=" << args.pipeline
+                  << ", sends=" << c.sends << ", ops=" << c.ops << ", reads=" << c.reads << ", writes=" << c.writes
+                  << ", keys=" << c.keys << ", unfinished=" << c.unfinished << ", busy=" << c.busy
+                  << ", secs=" << secs << ", qps=" << qps
+                  << ", keys_per_sec=" << (secs > 0 ? c.keys / secs : 0.0) << "\n";
+        std::cout << "latency_us: p50=" << summary.p50 << " p90=" << summary.p90 << " p99=" << summary.p99
+                  << " p999=" << summary.p999 << " max=" << summary.max << "\n";
+        if (args.servers.size() > 1) {
+            auto shares = ring.shares();
+            for (size_t e = 0; e < args.servers.size(); ++e)
+                std::cout << "endpoint " << args.servers[e].name() << ": ops=" << endpoint_ops[e]
+                          << " qps=" << (secs > 0 ? endpoint_ops[e] / secs : 0.0)
+                          << " ring_share=" << shares[e] << "\n";
+        }
+    }
     return 0;
 }
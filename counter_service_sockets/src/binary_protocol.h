@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Compact binary protocol, shared by counter_server and benchmark.
+//
+// A client selects it by sending MAGIC as the very first byte of the connection
+// (text commands always start with an ASCII letter, so both protocols can share a port).
+// After that every request is a fixed 8 byte header followed by key_len key bytes,
+// and every reply is a fixed 16 byte frame. Integers are in host byte order
+// (little-endian on all platforms we run on).
+namespace binproto {
+
+constexpr uint8_t MAGIC = 0xB7;
+constexpr uint16_t MAX_KEY_LEN = 4096;
+
+enum Opcode : uint8_t {
+    OP_INC = 1,
+    OP_GET = 2,
+    OP_STATS = 3,
+    OP_QUIT = 4,
+};
+
+enum Status : uint8_t {
+    ST_OK = 0,
+    ST_NOT_FOUND = 1,
+    ST_ERROR = 2,
+    ST_BYE = 3,
+    ST_BUSY = 4, // shed under overload (--shed-ms), not executed
+};
+
+struct RequestHeader {
+    uint8_t opcode;
+    uint8_t flags;    // reserved, must be 0
+    uint16_t key_len; // number of key bytes following the header
+    int32_t delta;    // INC only
+};
+static_assert(sizeof(RequestHeader) == 8, "RequestHeader must stay 8 bytes");
+
+struct Reply {
+    uint8_t status;
+    uint8_t pad[7];
+    int64_t value; // GET: counter value, STATS: number of keys
+};
+static_assert(sizeof(Reply) == 16, "Reply must stay 16 bytes");
+
+inline void append_request(std::string& out, Opcode op, std::string_view key = {}, int32_t delta = 0) {
+    RequestHeader h{op, 0, static_cast<uint16_t>(key.size()), delta};
+    out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.append(key.data(), key.size());
+}
+
+inline void append_reply(std::string& out, Status status, int64_t value = 0) {
+    Reply r{};
+    r.status = status;
+    r.value = value;
+    out.append(reinterpret_cast<const char*>(&r), sizeof(r));
+}
+
+// Decodes the header at p (memcpy, since frames are not aligned in the stream).
+inline RequestHeader read_header(const char* p) {
+    RequestHeader h;
+    std::memcpy(&h, p, sizeof(h));
+    return h;
+}
+
+inline Reply read_reply(const char* p) {
+    Reply r;
+    std::memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+} // namespace binproto
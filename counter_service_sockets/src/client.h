@@ -0,0 +1,177 @@
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "binary_protocol.h"
+
+// Client side of the counter service: connecting, framing replies, and spreading keys
+// over several independent servers. Every server owns the keys the ring maps to it;
+// the servers never talk to each other.
+
+struct Endpoint {
+    std::string host;
+    int port = 0;
+
+    std::string name() const { return host + ":" + std::to_string(port); }
+};
+
+// "host:port,host:port,..."; a bare port means 127.0.0.1. Errors throw std::string.
+inline std::vector<Endpoint> parse_endpoints(const std::string& list) {
+    std::vector<Endpoint> out;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        std::string item = list.substr(begin, end - begin);
+        begin = end + 1;
+        if (item.empty()) continue;
+        Endpoint e;
+        size_t colon = item.rfind(':');
+        std::string port = colon == std::string::npos ? item : item.substr(colon + 1);
+        e.host = colon == std::string::npos || colon == 0 ? "127.0.0.1" : item.substr(0, colon);
+        try {
+            size_t used = 0;
+            e.port = std::stoi(port, &used);
+            if (used != port.size() || e.port <= 0 || e.port > 65535) throw std::string();
+        } catch (...) {
+            throw std::string("Bad endpoint " + item + ", expected host:port");
+        }
+        out.push_back(std::move(e));
+    }
+    if (out.empty())
+        throw std::string("No endpoints in \"" + list + "\"");
+    return out;
+}
+
+// Consistent-hash ring: every endpoint is placed at `vnodes` pseudo-random points and a
+// key belongs to the first point at or after its hash. Adding or removing one of n
+// endpoints moves only about 1/n of the keys, and with ~100+ points per endpoint the
+// shares stay within a few percent of even. Points are derived from the endpoint's name,
+// so every client with the same list agrees on where a key lives.
+class HashRing {
+    std::vector<std::pair<uint64_t, uint32_t>> points_; // (hash, endpoint), sorted
+    size_t endpoints_ {0};
+
+    // fmix64: std::hash of short, similar strings differs mostly in the low bits
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+public:
+    static constexpr int DEFAULT_VNODES = 160;
+
+    static uint64_t hash_of(std::string_view key) { return mix(std::hash<std::string_view>{}(key)); }
+
+    HashRing(const std::vector<Endpoint>& endpoints, int vnodes = DEFAULT_VNODES) : endpoints_(endpoints.size()) {
+        vnodes = std::max(vnodes, 1);
+        points_.reserve(endpoints.size() * static_cast<size_t>(vnodes));
+        for (size_t e = 0; e < endpoints.size(); ++e) {
+            std::string base = endpoints[e].name() + "#";
+            for (int v = 0; v < vnodes; ++v)
+                points_.emplace_back(hash_of(base + std::to_string(v)), static_cast<uint32_t>(e));
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    size_t endpoints() const { return endpoints_; }
+
+    // Index into the endpoint list the ring was built from.
+    size_t route(std::string_view key) const {
+        if (endpoints_ <= 1) return 0;
+        uint64_t h = hash_of(key);
+        auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(h, uint32_t{0}));
+        if (it == points_.end()) it = points_.begin();
+        return it->second;
+    }
+
+    // Share of the hash space each endpoint owns, for checking the balance.
+    std::vector<double> shares() const {
+        std::vector<double> out(endpoints_, 0.0);
+        if (endpoints_ == 1) out[0] = 1.0;
+        if (endpoints_ <= 1) return out;
+        const double span = 18446744073709551616.0; // 2^64
+        for (size_t i = 0; i < points_.size(); ++i) {
+            uint64_t prev = i == 0 ? points_.back().first : points_[i - 1].first;
+            out[points_[i].second] += static_cast<double>(points_[i].first - prev) / span; // wraps for i == 0
+        }
+        return out;
+    }
+};
+
+inline int connect_tcp(const std::string& host, int port) {
+    struct addrinfo hints{}; hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = nullptr;
+    int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (rc != 0) {
+        std::cerr << "getaddrinfo: " << gai_strerror(rc) << "\n"; return -1;
+    }
+    int fd = -1;
+    for (auto p = res; p != nullptr; p = p->ai_next) {
+        fd = ::socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        ::close(fd); fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) perror("connect");
+    return fd;
+}
+
+inline bool write_all(int fd, const std::string& s) {
+    const char* p = s.data(); size_t left = s.size();
+    while (left > 0) {
+        ssize_t n = ::send(fd, p, left, 0);
+        if (n < 0) { if (errno == EINTR) continue; perror("send"); return false; }
+        left -= (size_t)n; p += n;
+    }
+    return true;
+}
+
+// Moves one complete reply (a text line or a fixed binary frame) from buf to out.
+inline bool take_reply(std::string& buf, bool binary, std::string& out) {
+    if (binary) {
+        if (buf.size() < sizeof(binproto::Reply)) return false;
+        out.assign(buf, 0, sizeof(binproto::Reply));
+        buf.erase(0, sizeof(binproto::Reply));
+        return true;
+    }
+    auto pos = buf.find('\n');
+    if (pos == std::string::npos) return false;
+    out.assign(buf, 0, pos);
+    buf.erase(0, pos + 1);
+    return true;
+}
+
+inline bool read_reply(int fd, std::string& out, std::string& buf, bool binary) {
+    while (true) {
+        if (take_reply(buf, binary, out)) return true;
+        char tmp[4096];
+        ssize_t n = ::recv(fd, tmp, sizeof(tmp), 0);
+        if (n == 0) return false;
+        if (n < 0) { if (errno == EINTR) continue; perror("recv"); return false; }
+        buf.append(tmp, tmp + n);
+    }
+}
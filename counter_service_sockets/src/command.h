@@ -0,0 +1,285 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "binary_protocol.h"
+
+// Protocol independent form of a request: parsed from a text line or a binary frame,
+// executed by the server, then formatted back in the protocol it arrived in.
+
+enum class CommandType {
+    INVALID,
+    QUIT,
+    STATS,
+    STATS_DETAIL, // text only, multi-line reply
+    INC,
+    GET,
+    MINC,
+    MGET,
+    TOPK          // text only, multi-line reply
+};
+
+// Keys point into the connection's input buffer and are only valid while the command
+// is being submitted; a command kept for later must be a copy_owned() of it.
+struct Command {
+    CommandType type {CommandType::INVALID};
+    bool binary {false};          // reply with a binproto frame instead of a text line
+    std::vector<std::string_view> keys;
+    std::vector<int> changes;     // INC / MINC, one per key; TOPK: n
+    std::vector<char> owned;      // key bytes after copy_owned(), a vector so moves keep the address
+
+    void clear() {
+        keys.clear();
+        changes.clear();
+        owned.clear();
+    }
+
+    // Makes this an owned copy of cmd in the capacity this command already has,
+    // so a reused Command does not allocate once it has held one as large.
+    void copy_owned(const Command &cmd) {
+        type = cmd.type;
+        binary = cmd.binary;
+        size_t total = 0;
+        for (auto key: cmd.keys) total += key.size();
+        grow(changes, cmd.changes.size());
+        grow(owned, total);
+        grow(keys, cmd.keys.size());
+        changes.assign(cmd.changes.begin(), cmd.changes.end());
+        owned.resize(total);
+        keys.resize(cmd.keys.size());
+        size_t off = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            std::memcpy(owned.data() + off, cmd.keys[i].data(), cmd.keys[i].size());
+            keys[i] = std::string_view(owned.data() + off, cmd.keys[i].size());
+            off += cmd.keys[i].size();
+        }
+    }
+
+private:
+    // capacity in powers of two: slightly longer keys in a reused slot do not reallocate each time
+    template <typename T>
+    static void grow(std::vector<T> &v, size_t n) {
+        if (n <= v.capacity())
+            return;
+        size_t cap = 16;
+        while (cap < n) cap *= 2;
+        v.reserve(cap);
+    }
+};
+
+struct CommandResult {
+    std::vector<int> values;      // GET / MGET, one per key
+    std::vector<char> found;
+    size_t keys_total {0};        // STATS
+    uint64_t evicted {0};         // STATS, keys evicted under --shard-memory
+    std::string text;             // STATS DETAIL / TOPK, preformatted by the server
+
+    void reset(size_t num_keys) {
+        values.assign(num_keys, 0);
+        found.assign(num_keys, 0);
+        keys_total = 0;
+        evicted = 0;
+        text.clear();
+    }
+};
+
+// Splits a line into whitespace separated tokens without copying.
+class Tokenizer {
+    std::string_view rest_;
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+public:
+    explicit Tokenizer(std::string_view line) : rest_(line) {}
+
+    // Empty view once the line is exhausted.
+    std::string_view next() {
+        size_t i = 0;
+        while (i < rest_.size() && is_space(rest_[i])) i++;
+        size_t j = i;
+        while (j < rest_.size() && !is_space(rest_[j])) j++;
+        std::string_view token = rest_.substr(i, j - i);
+        rest_.remove_prefix(j);
+        return token;
+    }
+};
+
+// Leading integer of token, like operator>>: false if there is none.
+inline bool parse_int(std::string_view token, int &value) {
+    const char *first = token.data(), *last = token.data() + token.size();
+    if (first != last && *first == '+') first++;
+    return !token.empty() && std::from_chars(first, last, value).ec == std::errc();
+}
+
+// Parses one text line (without the newline) in place. Returns false for empty or
+// unknown commands, which get no reply.
+inline bool parse_text_command(std::string_view line, Command &cmd) {
+    Tokenizer tok(line);
+    std::string_view cmd_name = tok.next();
+
+    cmd.binary = false;
+    cmd.clear();
+
+    if (cmd_name == "QUIT") {
+        cmd.type = CommandType::QUIT;
+    } else if (cmd_name == "STATS") {
+        cmd.type = tok.next() == "DETAIL" ? CommandType::STATS_DETAIL : CommandType::STATS;
+    } else if (cmd_name == "INC") {
+        cmd.type = CommandType::INC;
+        cmd.keys.push_back(tok.next());
+        std::string_view arg = tok.next();
+        int change = 1; // when omitted
+        if (!arg.empty() && !parse_int(arg, change))
+            change = 0;
+        cmd.changes.push_back(change);
+    } else if (cmd_name == "GET") {
+        cmd.type = CommandType::GET;
+        cmd.keys.push_back(tok.next());
+    } else if (cmd_name == "MINC") {
+        // MINC k1 d1 k2 d2 ..., stops at the first key without a valid delta
+        cmd.type = CommandType::MINC;
+        int change = 0;
+        for (std::string_view key = tok.next(); !key.empty(); key = tok.next()) {
+            if (!parse_int(tok.next(), change))
+                break;
+            cmd.keys.push_back(key);
+            cmd.changes.push_back(change);
+        }
+    } else if (cmd_name == "TOPK") {
+        cmd.type = CommandType::TOPK;
+        int n = 10;
+        parse_int(tok.next(), n);
+        cmd.changes.push_back(n);
+    } else if (cmd_name == "MGET") {
+        // MGET k1 k2 ...
+        cmd.type = CommandType::MGET;
+        for (std::string_view key = tok.next(); !key.empty(); key = tok.next()) {
+            cmd.keys.push_back(key);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Unknown opcodes become INVALID commands, answered with ST_ERROR.
+inline void parse_binary_command(const binproto::RequestHeader &h, const char *key_data, Command &cmd) {
+    cmd.binary = true;
+    cmd.clear();
+
+    switch (h.opcode) {
+        case binproto::OP_INC:
+            cmd.type = CommandType::INC;
+            cmd.keys.emplace_back(key_data, h.key_len);
+            cmd.changes.push_back(h.delta);
+            break;
+        case binproto::OP_GET:
+            cmd.type = CommandType::GET;
+            cmd.keys.emplace_back(key_data, h.key_len);
+            break;
+        case binproto::OP_STATS:
+            cmd.type = CommandType::STATS;
+            break;
+        case binproto::OP_QUIT:
+            cmd.type = CommandType::QUIT;
+            break;
+        default:
+            cmd.type = CommandType::INVALID;
+            break;
+    }
+}
+
+inline void append_int(std::string &out, long long value) {
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, r.ptr);
+}
+
+// Reply to a command that was shed without being executed.
+inline void append_busy_reply(const Command &cmd, std::string &out) {
+    if (cmd.binary)
+        binproto::append_reply(out, binproto::ST_BUSY);
+    else
+        out += "BUSY\n";
+}
+
+// Appends into out's existing capacity; connections keep their output buffer between batches.
+inline void append_reply(const Command &cmd, const CommandResult &res, std::string &out) {
+    if (cmd.binary) {
+        switch (cmd.type) {
+            case CommandType::QUIT:
+                binproto::append_reply(out, binproto::ST_BYE);
+                break;
+            case CommandType::STATS:
+                binproto::append_reply(out, binproto::ST_OK, static_cast<int64_t>(res.keys_total));
+                break;
+            case CommandType::GET:
+                if (res.found[0])
+                    binproto::append_reply(out, binproto::ST_OK, res.values[0]);
+                else
+                    binproto::append_reply(out, binproto::ST_NOT_FOUND);
+                break;
+            case CommandType::INC:
+                binproto::append_reply(out, binproto::ST_OK);
+                break;
+            default:
+                binproto::append_reply(out, binproto::ST_ERROR);
+                break;
+        }
+        return;
+    }
+
+    switch (cmd.type) {
+        case CommandType::QUIT:
+            out += "BYE\n";
+            break;
+        case CommandType::STATS:
+            out += "STATS post counters=";
+            append_int(out, static_cast<long long>(res.keys_total));
+            out += " evicted=";
+            append_int(out, static_cast<long long>(res.evicted));
+            out += '\n';
+            break;
+        case CommandType::STATS_DETAIL:
+        case CommandType::TOPK:
+            out += res.text;
+            break;
+        case CommandType::INC:
+            out += "OK\n";
+            break;
+        case CommandType::GET:
+            if (res.found[0]) {
+                out += "VALUE ";
+                append_int(out, res.values[0]);
+                out += '\n';
+            } else {
+                out += "key not found\n";
+            }
+            break;
+        case CommandType::MINC:
+            out += "OK ";
+            append_int(out, static_cast<long long>(cmd.keys.size()));
+            out += '\n';
+            break;
+        case CommandType::MGET:
+            // VALUES v1 v2 ..., "-" for missing keys
+            out += "VALUES";
+            for (size_t i = 0; i < cmd.keys.size(); i++) {
+                out += ' ';
+                if (res.found[i])
+                    append_int(out, res.values[i]);
+                else
+                    out += '-';
+            }
+            out += '\n';
+            break;
+        default:
+            break;
+    }
+}
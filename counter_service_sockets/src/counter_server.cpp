@@ -4,27 +4,78 @@
 #include <string>
 #include <unordered_map>
 #include <thread>
+#include <tuple>
+#include <iterator>
+#include <limits>
 #include <vector>
 
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <csignal> // For signal handling
 #include <unistd.h> // For sleep (optional, for demonstration)
 #include <mutex>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <malloc.h>
 
+#include "binary_protocol.h"
+#include "command.h"
+#include "flat_map.h"
+#include "persistence.h"
+#include "histogram.h"
+#include "io_buffer.h"
+#include "spill.h"
+#include "topk.h"
+#include "spsc_queue.h"
+#include "uring.h"
+
+
+enum class IoMode {
+    BLOCKING, // one client per thread, blocking recv/send
+    EPOLL,    // N event loops, each multiplexing many non-blocking clients
+    URING     // N io_uring loops: multishot accept/recv into provided buffers, batched sends
+};
 
 struct Settings {
-    int port {};
-    bool verbose {};
-    int num_threads {};
+    int port {9000};
+    bool verbose {true};
+    int num_threads {4};
+    IoMode mode {IoMode::BLOCKING};
+    bool shared_nothing {false}; // per-core listeners and key partitions, implies epoll
+    int num_shards {64};         // independent of the thread count, except in shared-nothing mode
+
+    std::string data_dir;        // enables the write-ahead log and snapshots when set
+    int sync_ms {10};            // group commit interval of the log
+    int snapshot_secs {300};     // 0 = snapshot only on shutdown
+
+    int combine_keys {0};        // > 0: write-combine INCs per thread, up to this many distinct keys
+    int topk_capacity {128};     // keys monitored per shard for TOPK, 0 = off
+
+    size_t shard_memory {0};     // bytes of keys per shard before cold ones are evicted, 0 = unbounded
+    std::string spill_dir;       // evicted keys go to a file here instead of being dropped
+
+    size_t max_input {256 << 10};  // unparsed bytes buffered per connection before reading pauses
+    size_t max_output {1 << 20};   // unsent reply bytes per connection before execution pauses
+    int conn_budget {256};         // commands per connection per event-loop pass
+    int shed_ms {0};               // answer BUSY to commands buffered longer than this, 0 = never
 };
 
 volatile sig_atomic_t terminate_flag = 0;
 
-void sigint_handler(int signum) {
+void sigint_handler(int /*signum*/) {
     std::cout << "\nCtrl+C detected. Initiating graceful shutdown..." << std::endl;
     terminate_flag = 1;
 }
@@ -40,36 +91,268 @@ static void install_sigint_handler() {
 }
 
 
-size_t get_shard_index(const std::string& key, size_t num_shards) {
-    return std::hash<std::string>{}(key) % num_shards;
+inline uint64_t key_hash(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
 }
 
+size_t get_shard_index(std::string_view key, size_t num_shards) {
+    return key_hash(key) % num_shards;
+}
+
+
+// Raise the soft fd limit up to the hard one, so one process can hold 10k+ keep-alive clients.
+static void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw std::string("Can not make socket non-blocking");
+    }
+}
 
-struct ServerData {
-    std::unordered_map<std::string, int> post_counters;
+
+struct alignas(64) ServerData {
+    FlatCounterMap post_counters;
     std::mutex mtx;
-    size_t requests;
+
+    // written under mtx (or by the owning loop in shared-nothing mode), read by STATS DETAIL
+    std::atomic<uint64_t> requests {0};
+    std::atomic<uint64_t> contended {0};    // lock acquisitions that had to wait
+    std::atomic<uint64_t> lock_wait_ns {0}; // total time spent waiting for mtx
+
+    TopKeys topk;         // heaviest keys of this shard, guarded by mtx
+
+    // --shard-memory: CLOCK eviction of cold keys, optionally into a spill file, under mtx like the counters
+    std::atomic<uint64_t> evictions {0};
+    std::atomic<uint64_t> dropped {0};      // evicted without a spill file, or too long for it
+    std::unique_ptr<SpillFile> spill;
+
+    // persistence, guarded by mtx like the counters
+    uint64_t seq {0};     // number of the last INC applied to this shard
+    std::string wal_buf;  // log records not yet handed to the log writer
+};
+
+enum class Protocol {
+    UNKNOWN, // nothing received yet
+    TEXT,
+    BINARY   // first byte was binproto::MAGIC
 };
 
+struct EventLoop;
+
+// A command whose reply can not be sent yet: in shared-nothing mode some of its
+// keys live on other cores. Replies leave in request order, so later commands queue behind it.
+struct PendingReply {
+    Command cmd;
+    CommandResult result;
+    size_t waiting {0}; // remote lookups still in flight
+    std::chrono::steady_clock::time_point start;
+};
+
+// FIFO of a connection's PendingReply. A ring that keeps its slots, with their key and
+// result vectors, from one use to the next, so a steady pipeline does not allocate; it only
+// grows past the deepest backlog seen so far.
+class PendingQueue {
+    std::vector<PendingReply> slots_; // power-of-two size
+    size_t head_ {0};
+    size_t size_ {0};
+
+    void grow() {
+        std::vector<PendingReply> bigger(std::max<size_t>(8, 2 * slots_.size()));
+        for (size_t i = 0; i < slots_.size(); i++)
+            bigger[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+        slots_.swap(bigger);
+        head_ = 0;
+    }
+
+public:
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    PendingReply &front() { return slots_[head_]; }
+    PendingReply &operator[](size_t i) { return slots_[(head_ + i) & (slots_.size() - 1)]; }
+
+    // A slot at the back, still holding what its previous use left in it.
+    PendingReply &push_back() {
+        if (size_ == slots_.size())
+            grow();
+        return slots_[(head_ + size_++) & (slots_.size() - 1)];
+    }
+
+    // an emptied queue restarts at slot 0, so a steady pipeline keeps reusing the same warm slots
+    void pop_front() {
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        if (--size_ == 0)
+            head_ = 0;
+    }
+};
+
+// State of one client: bytes received but not yet parsed,
+// and replies produced but not yet accepted by the kernel.
+struct Connection {
+    int fd {-1};
+    uint64_t id {0};
+    EventLoop *loop {nullptr}; // set in shared-nothing mode only
+    Protocol proto {Protocol::UNKNOWN};
+    InputBuffer inbuf;
+    std::string outbuf; // cleared, never shrunk, after each send
+    size_t out_off {0};
+    bool closing {false}; // QUIT received, close once outbuf is flushed
+
+    // overload handling: buffers are bounded and every pass executes a limited number of commands
+    std::chrono::steady_clock::time_point input_since; // recv of the oldest complete command, {} if none
+    bool read_paused {false}; // stopped reading at max_input, the socket may hold more
+    bool peer_closed {false}; // EOF seen, the buffered commands still run
+    bool ready {false};       // in the loop's ready list
+    bool recent_input {false}; // received bytes since the last idle sweep
+
+    PendingQueue pending;
+    uint64_t pending_base {0}; // sequence number of pending.front()
+    bool dirty {false};        // got remote results during this loop iteration
+};
+
+// Message between two shared-nothing loops. INC is fire-and-forget: every (src, dst)
+// mailbox is FIFO, so a later GET from the same loop still observes it.
+// The key of an INC / GET sits in the mailbox's byte ring; only a message parked while the
+// mailbox was full, or one with a key too long for the ring, carries its own copy.
+struct Message {
+    enum Kind : uint8_t { INC, GET, VALUE };
+
+    Kind kind {INC};
+    bool found {false};
+    uint32_t index {0};   // key position inside the command
+    int value {0};        // INC: delta, VALUE: counter
+    uint64_t conn_id {0}; // GET / VALUE: where the result goes back to
+    uint64_t seq {0};
+    uint64_t key_pos {0}; // in the mailbox's key ring
+    uint32_t key_len {0}; // > 0: the key is in the ring, otherwise in own_key
+    std::string own_key;
+};
+
+// Per-thread state of an event loop.
+struct EventLoop {
+    int id {0};
+    int epfd {-1};
+    int listen_fd {-1};
+    int wake_fd {-1}; // eventfd poked by other loops after they fill our mailbox
+    uint64_t next_conn_id {1};
+    std::unordered_map<int, std::unique_ptr<Connection>> conns; // by fd
+    std::unordered_map<uint64_t, Connection*> by_id;
+
+    std::vector<std::deque<Message>> overflow; // per destination, used while its mailbox is full
+    std::vector<char> notify;                  // destinations written to during this iteration
+    std::vector<uint64_t> dirty;               // connections with completed remote results
+    std::vector<uint64_t> ready;               // connections with work left after their pass, round-robin
+
+    alignas(64) std::atomic<size_t> key_count {0}; // keys owned by this loop, for STATS
+};
+
+// io_uring client: the shared Connection plus its in-flight operations. A send owns
+// its buffer until it completes, so new replies collect in conn.outbuf meanwhile.
+struct UringConn {
+    Connection conn;
+    std::string sending;
+    size_t send_off {0};
+    bool send_active {false};
+    bool recv_active {false};
+    bool shut {false};   // shut down, freed once no operation references it
+    bool queued {false}; // in the loop's send list
+    bool recv_paused {false}; // recv cancelled at max_input, re-armed once the buffer drains
+};
+
+constexpr size_t NUM_COMMAND_TYPES = static_cast<size_t>(CommandType::TOPK) + 1;
+
+static const char *command_name(CommandType type) {
+    switch (type) {
+        case CommandType::QUIT: return "QUIT";
+        case CommandType::STATS: return "STATS";
+        case CommandType::STATS_DETAIL: return "STATS_DETAIL";
+        case CommandType::INC: return "INC";
+        case CommandType::GET: return "GET";
+        case CommandType::MINC: return "MINC";
+        case CommandType::MGET: return "MGET";
+        case CommandType::TOPK: return "TOPK";
+        default: return "INVALID";
+    }
+}
+
+// Per-command latency, recorded into thread-local histograms and merged by STATS DETAIL.
+ThreadHistograms<NUM_COMMAND_TYPES> command_latency;
+
+static void record_latency(CommandType type, std::chrono::steady_clock::time_point start) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    command_latency.local(static_cast<size_t>(type)).record(static_cast<uint64_t>(ns));
+}
+
+static void pin_to_cpu(int cpu) {
+    unsigned ncpu = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        std::cerr << "pthread_setaffinity_np: " << strerror(rc) << std::endl;
+    }
+}
+
 class Server {
-    int server_fd;
-    const int q_size = 512;
+    friend struct ServerProbe; // tests/zero_alloc.cpp drives process_input directly
+
+    int server_fd {-1};
+    int port;
+    const int q_size = 4096;
+    const int max_events = 256;
+    const size_t mailbox_size = 4096;
+    const size_t mailbox_key_bytes = 64 * 1024; // key ring per mailbox
+    const int mailbox_batch = 1024; // messages taken from one mailbox per iteration
+    const unsigned uring_entries = 4096;
+    const unsigned uring_buffers = 1024;   // provided recv buffers per loop, power of two
+    const unsigned uring_buf_size = 4096;
 
     int num_shards;
     int num_threads;
+    bool shared_nothing;
     std::vector<ServerData> shards;
 
-    void connect_to_socket(int port) {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd < 0) {
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::vector<std::unique_ptr<SpscQueue<Message>>> mailboxes; // [src * num_threads + dst]
+    std::vector<std::unique_ptr<SpscByteRing>> mailbox_keys;    // same index, the messages' keys
+
+    std::string data_dir;
+    int sync_ms;
+    int snapshot_secs;
+    int combine_keys;
+    bool topk_enabled;
+    size_t shard_memory;
+
+    size_t max_input;
+    size_t max_output;
+    int conn_budget;
+    std::chrono::milliseconds shed_after;
+    std::atomic<uint64_t> shed {0};     // commands answered BUSY, plus connections dropped for an oversized command
+    std::atomic<uint64_t> deferred {0}; // passes that stopped at a budget or a full buffer and were resumed later
+    std::unique_ptr<persist::WalFile> wal; // null when persistence is off
+    std::mutex wal_mtx;                    // serializes commits and rotation
+    std::mutex persist_mtx;
+    std::condition_variable persist_cv;    // wakes the background threads at shutdown
+    bool persist_stop {false};
+
+    int open_listener(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
             throw std::string("Can not create socket");
         }
 
         int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
             throw std::string("setsockopt (SO_REUSEADDR) failed");
         }
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
             throw std::string("setsockopt (SO_REUSEPORT) failed");
         }
 
@@ -78,121 +361,1533 @@ class Server {
         address.sin_addr.s_addr = INADDR_ANY;
         address.sin_port = htons(port); // Host to network short
 
-        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
             throw std::string("Can't bind to port");
         }
 
-        std::cout << "Server bound to port " << port << std::endl;
-
-        if (listen(server_fd, q_size) < 0) { // 512 is the backlog queue size
+        if (listen(fd, q_size) < 0) {
             throw std::string("can't listen on socket");
         }
+        return fd;
+    }
 
+    void connect_to_socket(int port) {
+        server_fd = open_listener(port);
+        std::cout << "Server bound to port " << port << std::endl;
         std::cout << "listenning to connections... " << std::endl;
     }
 
     void close_socket() {
-        close(server_fd);
+        if (server_fd >= 0)
+            close(server_fd);
     }
 
-    bool read_line(int fd, std::string& out, std::string& buf) {
-        // Look for '\n' in existing buffer first.
-        while (true) {
-            auto pos = buf.find('\n');
-            if (pos != std::string::npos) {
-                out = buf.substr(0, pos);
-                buf.erase(0, pos + 1);
+    // ---- counter operations on the mutex-protected shards
+
+    // Locks a shard, counting how often and how long callers had to wait for it.
+    // The uncontended path costs a single try_lock.
+    static std::unique_lock<std::mutex> lock_shard(ServerData &shard) {
+        std::unique_lock<std::mutex> lock(shard.mtx, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            auto t0 = std::chrono::steady_clock::now();
+            lock.lock();
+            auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0);
+            stat_add(shard.contended);
+            stat_add(shard.lock_wait_ns, waited.count());
+        }
+        return lock;
+    }
+
+    // ---- write combining (--combine): INC deltas wait in a per-thread table and reach the
+    // shards in one locked pass per shard when the thread's I/O batch ends or the table fills.
+    // GET/MGET add the calling thread's pending deltas, so a connection always reads its own
+    // INCs; other threads see them at most one event-loop iteration (or recv batch) late.
+
+    static FlatCounterMap &pending_deltas() {
+        thread_local FlatCounterMap pending;
+        return pending;
+    }
+
+    void combine(std::string_view key, int change) {
+        FlatCounterMap &pending = pending_deltas();
+        pending.add(key, change);
+        if (pending.size() >= static_cast<size_t>(combine_keys))
+            flush_combined();
+    }
+
+    void add_pending(std::string_view key, int &value, char &found) {
+        int delta;
+        if (combine_keys > 0 && pending_deltas().find(key, delta)) {
+            value = found ? value + delta : delta;
+            found = 1;
+        }
+    }
+
+    // Applies this thread's pending deltas, locking every touched shard once.
+    void flush_combined() {
+        if (combine_keys == 0)
+            return;
+        FlatCounterMap &pending = pending_deltas();
+        if (pending.size() == 0)
+            return;
+        thread_local std::vector<std::tuple<size_t, std::string_view, int>> batch; // (shard, key, delta)
+        batch.clear();
+        pending.for_each([&](std::string_view key, int delta) {
+            if (delta != 0)
+                batch.emplace_back(get_shard_index(key, num_shards), key, delta);
+        });
+        std::sort(batch.begin(), batch.end(),
+                  [](const auto &a, const auto &b) { return std::get<0>(a) < std::get<0>(b); });
+        for (size_t i = 0; i < batch.size();) {
+            size_t shard_idx = std::get<0>(batch[i]);
+            auto lock = lock_shard(shards[shard_idx]);
+            for (; i < batch.size() && std::get<0>(batch[i]) == shard_idx; i++) {
+                auto [_, key, delta] = batch[i];
+                add_locked(shards[shard_idx], key, delta);
+                stat_add(shards[shard_idx].requests);
+                log_increment(shard_idx, key, delta);
+            }
+        }
+        pending.clear();
+    }
+
+    // Caller holds shard.mtx, or owns the shard in shared-nothing mode without a log; then
+    // only the top-key heap is shared and lock_topk takes the lock around its update.
+    // Returns how many keys the shard gained: 1 for a new key, minus the evicted ones.
+    int add_locked(ServerData &shard, std::string_view key, uint64_t h, int change, bool lock_topk = false) {
+        int total;
+        int keys = shard.post_counters.add(key, h, change, total) ? 1 : 0;
+        int delta = change;
+        int spilled;
+        if (keys == 1 && shard.spill && shard.spill->take(key, spilled)) {
+            // back from disk with its count
+            shard.post_counters.add(key, h, spilled, total);
+            delta += spilled;
+        }
+        if (topk_enabled && !shard.topk.ignores(total, delta)) {
+            if (lock_topk) {
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                shard.topk.update(key, h, total, delta);
+            } else {
+                shard.topk.update(key, h, total, delta);
+            }
+        }
+        if (keys == 1 && shard_memory > 0)
+            keys -= evict_cold(shard, lock_topk);
+        return keys;
+    }
+
+    int add_locked(ServerData &shard, std::string_view key, int change) {
+        return add_locked(shard, key, key_hash(key), change);
+    }
+
+    // Evicts keys the CLOCK hand finds unused until the shard fits its --shard-memory budget.
+    // A spilled key keeps its count and its place among the top keys; a dropped one leaves them.
+    int evict_cold(ServerData &shard, bool lock_topk) {
+        int evicted = 0;
+        while (shard.post_counters.live_bytes() > shard_memory) {
+            bool ok = shard.post_counters.evict_one([&](std::string_view key, int value) {
+                if (shard.spill && shard.spill->add(key, value))
+                    return;
+                stat_add(shard.dropped);
+                if (topk_enabled) {
+                    if (lock_topk) {
+                        std::lock_guard<std::mutex> lock(shard.mtx);
+                        shard.topk.remove(key, key_hash(key));
+                    } else {
+                        shard.topk.remove(key, key_hash(key));
+                    }
+                }
+            });
+            if (!ok)
+                break;
+            stat_add(shard.evictions);
+            evicted++;
+        }
+        return evicted;
+    }
+
+    // Caller holds shard.mtx (or owns the shard). Falls back to the spill file.
+    bool find_locked(ServerData &shard, std::string_view key, uint64_t h, int &value) {
+        if (shard.post_counters.find(key, h, value))
+            return true;
+        return shard.spill && shard.spill->find(key, value);
+    }
+
+    void increment(std::string_view key, int change) {
+        if (combine_keys > 0) {
+            combine(key, change);
+            return;
+        }
+        // Hash key to determine which shard to use, the table reuses the same hash
+        uint64_t h = key_hash(key);
+        size_t shard_idx = h % num_shards;
+        auto lock = lock_shard(shards[shard_idx]);
+        add_locked(shards[shard_idx], key, h, change);
+        stat_add(shards[shard_idx].requests);
+        log_increment(shard_idx, key, change);
+    }
+
+    bool lookup(std::string_view key, int &value) {
+        uint64_t h = key_hash(key);
+        size_t shard_idx = h % num_shards;
+        char found;
+        {
+            auto lock = lock_shard(shards[shard_idx]);
+            stat_add(shards[shard_idx].requests);
+            found = find_locked(shards[shard_idx], key, h, value);
+        }
+        add_pending(key, value, found);
+        return found;
+    }
+
+    // Orders key positions by shard so that each touched shard is locked only once per batch.
+    std::vector<std::pair<size_t, size_t>> group_by_shard(const std::vector<std::string_view> &keys) {
+        std::vector<std::pair<size_t, size_t>> order; // (shard, key position)
+        order.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            order.emplace_back(get_shard_index(keys[i], num_shards), i);
+        }
+        std::sort(order.begin(), order.end());
+        return order;
+    }
+
+    void multi_increment(const std::vector<std::string_view> &keys, const std::vector<int> &changes) {
+        if (combine_keys > 0) {
+            for (size_t k = 0; k < keys.size(); k++)
+                combine(keys[k], changes[k]);
+            return;
+        }
+        auto order = group_by_shard(keys);
+        for (size_t i = 0; i < order.size();) {
+            size_t shard_idx = order[i].first;
+            auto lock = lock_shard(shards[shard_idx]);
+            for (; i < order.size() && order[i].first == shard_idx; i++) {
+                size_t k = order[i].second;
+                add_locked(shards[shard_idx], keys[k], changes[k]);
+                stat_add(shards[shard_idx].requests);
+                log_increment(shard_idx, keys[k], changes[k]);
+            }
+        }
+    }
+
+    // found[i] is set to 0 for keys that do not exist.
+    void multi_lookup(const std::vector<std::string_view> &keys, std::vector<int> &values, std::vector<char> &found) {
+        values.assign(keys.size(), 0);
+        found.assign(keys.size(), 0);
+        auto order = group_by_shard(keys);
+        for (size_t i = 0; i < order.size();) {
+            size_t shard_idx = order[i].first;
+            auto lock = lock_shard(shards[shard_idx]);
+            for (; i < order.size() && order[i].first == shard_idx; i++) {
+                size_t k = order[i].second;
+                stat_add(shards[shard_idx].requests);
+                found[k] = find_locked(shards[shard_idx], keys[k], key_hash(keys[k]), values[k]);
+            }
+        }
+        for (size_t k = 0; k < keys.size(); k++)
+            add_pending(keys[k], values[k], found[k]);
+    }
+
+    size_t count_keys() {
+        size_t sum_size = 0;
+        if (shared_nothing) {
+            for (const auto &loop: loops) {
+                sum_size += loop->key_count.load(std::memory_order_relaxed);
+            }
+            return sum_size;
+        }
+        for(auto &shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            sum_size += shard.post_counters.size();
+        }
+        return sum_size;
+    }
+
+    uint64_t count_evictions() const {
+        uint64_t sum = 0;
+        for (const auto &shard: shards)
+            sum += shard.evictions.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    // Multi-line STATS DETAIL reply: "STATS DETAIL <lines>", then one line per
+    // command type with latency percentiles and one line per shard.
+    std::string detail_stats() {
+        std::vector<std::string> lines;
+        char line[256];
+        for (size_t t = 0; t < NUM_COMMAND_TYPES; t++) {
+            auto counts = command_latency.merged(t);
+            uint64_t total = 0;
+            for (uint64_t c: counts) total += c;
+            if (total == 0)
+                continue;
+            snprintf(line, sizeof(line), "cmd=%s count=%llu p50_us=%.2f p99_us=%.2f p999_us=%.2f max_us=%.2f\n",
+                     command_name(static_cast<CommandType>(t)), static_cast<unsigned long long>(total),
+                     Histogram::percentile(counts, 0.5) / 1e3, Histogram::percentile(counts, 0.99) / 1e3,
+                     Histogram::percentile(counts, 0.999) / 1e3, Histogram::percentile(counts, 1.0) / 1e3);
+            lines.emplace_back(line);
+        }
+        for (int s = 0; s < num_shards; s++) {
+            size_t keys;
+            int n = 0;
+            if (shared_nothing) {
+                keys = loops.empty() ? 0 : loops[s]->key_count.load(std::memory_order_relaxed);
+            } else {
+                std::lock_guard<std::mutex> lock(shards[s].mtx);
+                keys = shards[s].post_counters.size();
+            }
+            n += snprintf(line, sizeof(line), "shard=%d keys=%zu requests=%llu contended=%llu lock_wait_us=%.1f", s, keys,
+                          static_cast<unsigned long long>(shards[s].requests.load(std::memory_order_relaxed)),
+                          static_cast<unsigned long long>(shards[s].contended.load(std::memory_order_relaxed)),
+                          shards[s].lock_wait_ns.load(std::memory_order_relaxed) / 1e3);
+            if (shard_memory > 0) {
+                n += snprintf(line + n, sizeof(line) - n, " evicted=%llu dropped=%llu",
+                              static_cast<unsigned long long>(shards[s].evictions.load(std::memory_order_relaxed)),
+                              static_cast<unsigned long long>(shards[s].dropped.load(std::memory_order_relaxed)));
+                if (!shared_nothing) { // a loop's map and spill file are only safe to read for their owner
+                    std::lock_guard<std::mutex> lock(shards[s].mtx);
+                    n += snprintf(line + n, sizeof(line) - n, " bytes=%zu spilled=%zu",
+                                  shards[s].post_counters.memory_bytes(),
+                                  shards[s].spill ? shards[s].spill->size() : size_t {0});
+                }
+            }
+            snprintf(line + n, sizeof(line) - n, "\n");
+            lines.emplace_back(line);
+        }
+
+        snprintf(line, sizeof(line), "overload shed=%llu deferred=%llu\n",
+                 static_cast<unsigned long long>(shed.load(std::memory_order_relaxed)),
+                 static_cast<unsigned long long>(deferred.load(std::memory_order_relaxed)));
+        lines.emplace_back(line);
+
+        std::string out = "STATS DETAIL " + std::to_string(lines.size()) + "\n";
+        for (const auto &l: lines)
+            out += l;
+        return out;
+    }
+
+    // "TOPK <k>" and k lines "<key> <count>", highest count first. Every shard
+    // contributes its own top n, keys never span shards, so merging needs no lookups.
+    std::string top_keys(int n) {
+        std::vector<TopKeys::Item> all;
+        if (topk_enabled && n > 0) {
+            for (auto &shard: shards) {
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto items = shard.topk.top(static_cast<size_t>(n));
+                std::move(items.begin(), items.end(), std::back_inserter(all));
+            }
+        }
+        size_t k = std::min(all.size(), static_cast<size_t>(std::max(n, 0)));
+        std::partial_sort(all.begin(), all.begin() + k, all.end(),
+                          [](const auto &a, const auto &b) { return a.count > b.count; });
+
+        std::string out = "TOPK ";
+        append_int(out, static_cast<long long>(k));
+        out += '\n';
+        for (size_t i = 0; i < k; i++) {
+            out += all[i].key;
+            out += ' ';
+            append_int(out, all[i].count);
+            out += '\n';
+        }
+        return out;
+    }
+
+    void execute_locked(const Command &cmd, CommandResult &res) {
+        switch (cmd.type) {
+            case CommandType::INC:
+                increment(cmd.keys[0], cmd.changes[0]);
+                break;
+            case CommandType::GET:
+                res.reset(1);
+                res.found[0] = lookup(cmd.keys[0], res.values[0]);
+                break;
+            case CommandType::MINC:
+                multi_increment(cmd.keys, cmd.changes);
+                break;
+            case CommandType::MGET:
+                multi_lookup(cmd.keys, res.values, res.found);
+                break;
+            case CommandType::STATS:
+                res.keys_total = count_keys();
+                res.evicted = count_evictions();
+                break;
+            case CommandType::STATS_DETAIL:
+                res.text = detail_stats();
+                break;
+            case CommandType::TOPK:
+                flush_combined(); // pending deltas of this thread count too
+                res.text = top_keys(cmd.changes[0]);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Executes one parsed command and queues its reply on the connection.
+    void submit(Connection &conn, Command &cmd) {
+        auto start = std::chrono::steady_clock::now();
+        if (cmd.type == CommandType::QUIT)
+            conn.closing = true;
+
+        if (conn.loop != nullptr) {
+            submit_shared_nothing(*conn.loop, conn, cmd, start);
+            return;
+        }
+
+        thread_local CommandResult res; // reused, keeps its capacity
+        execute_locked(cmd, res);
+        append_reply(cmd, res, conn.outbuf);
+        record_latency(cmd.type, start);
+    }
+
+    // ---- persistence: write-ahead log with group commit, plus background snapshots
+
+    // Called with the shard lock held.
+    void log_increment(size_t shard_idx, std::string_view key, int change) {
+        if (!wal)
+            return;
+        ServerData &shard = shards[shard_idx];
+        persist::append_wal_record(shard.wal_buf, static_cast<uint32_t>(shard_idx), ++shard.seq, key, change);
+    }
+
+    // Moves every shard's pending records into one buffer: one write + one fdatasync for all of them.
+    // Must hold wal_mtx.
+    void commit_wal_locked() {
+        std::string batch;
+        for (auto &shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            if (batch.empty())
+                batch.swap(shard.wal_buf);
+            else
+                batch += shard.wal_buf;
+            shard.wal_buf.clear();
+        }
+        wal->commit(batch);
+    }
+
+    void wal_worker() {
+        std::unique_lock<std::mutex> lk(persist_mtx);
+        while (!persist_stop) {
+            persist_cv.wait_for(lk, std::chrono::milliseconds(sync_ms));
+            lk.unlock();
+            {
+                std::lock_guard<std::mutex> wl(wal_mtx);
+                commit_wal_locked();
+            }
+            lk.lock();
+        }
+    }
+
+    // Writes snapshot.bin. Writers of a shard are blocked only while that shard is
+    // serialized into memory, never during disk I/O.
+    void take_snapshot() {
+        auto t0 = std::chrono::steady_clock::now();
+
+        // rotate first: every record in older generations is then covered by this snapshot
+        uint64_t new_gen;
+        {
+            std::lock_guard<std::mutex> wl(wal_mtx);
+            commit_wal_locked();
+            new_gen = wal->gen() + 1;
+            wal->open(new_gen);
+        }
+
+        std::string tmp_path = persist::snapshot_path(data_dir) + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("open(snapshot)");
+            return;
+        }
+
+        persist::SnapshotHeader header{};
+        std::memcpy(header.magic, persist::SNAP_MAGIC, sizeof(header.magic));
+        header.version = persist::VERSION;
+        header.num_shards = num_shards;
+        header.wal_gen = new_gen;
+        std::vector<persist::SnapshotShard> index(num_shards);
+
+        uint64_t offset = sizeof(header) + sizeof(persist::SnapshotShard) * num_shards;
+        bool ok = true;
+        std::string buf;
+        for (int s = 0; s < num_shards && ok; s++) {
+            buf.clear();
+            {
+                std::lock_guard<std::mutex> lock(shards[s].mtx);
+                index[s].seq = shards[s].seq;
+                index[s].keys = shards[s].post_counters.size();
+                shards[s].post_counters.for_each([&](std::string_view key, int value) {
+                    persist::append_snapshot_entry(buf, key, value);
+                });
+                if (shards[s].spill) {
+                    // a key is either in memory or spilled, never both
+                    index[s].keys += shards[s].spill->size();
+                    shards[s].spill->for_each([&](std::string_view key, int value) {
+                        persist::append_snapshot_entry(buf, key, value);
+                    });
+                }
+            }
+            index[s].offset = offset;
+            index[s].bytes = buf.size();
+            header.total_keys += index[s].keys;
+            ok = persist::pwrite_fully(fd, buf.data(), buf.size(), offset);
+            offset += buf.size();
+        }
+
+        ok = ok && persist::pwrite_fully(fd, &header, sizeof(header), 0)
+                && persist::pwrite_fully(fd, index.data(), sizeof(persist::SnapshotShard) * num_shards, sizeof(header))
+                && ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tmp_path.c_str(), persist::snapshot_path(data_dir).c_str()) != 0) {
+            perror("write(snapshot)");
+            return;
+        }
+        persist::fsync_dir(data_dir);
+
+        for (uint64_t gen: persist::list_wal_gens(data_dir)) {
+            if (gen < new_gen)
+                ::unlink(persist::wal_path(data_dir, gen).c_str());
+        }
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "snapshot: " << header.total_keys << " keys, " << offset / 1e6 << " MB in " << secs << " s" << std::endl;
+    }
+
+    void snapshot_worker() {
+        std::unique_lock<std::mutex> lk(persist_mtx);
+        while (!persist_stop) {
+            persist_cv.wait_for(lk, std::chrono::seconds(snapshot_secs), [&] { return persist_stop; });
+            if (persist_stop)
+                break;
+            lk.unlock();
+            take_snapshot();
+            lk.lock();
+        }
+    }
+
+    // Loads snapshot.bin (shards in parallel, each thread filling its own shards, so no locks)
+    // and replays the log generations it does not cover. Prints how long each part took.
+    void recover() {
+        ::mkdir(data_dir.c_str(), 0755);
+        auto t0 = std::chrono::steady_clock::now();
+
+        std::vector<uint64_t> snap_seq(num_shards, 0);
+        uint64_t first_gen = 0;
+        size_t snap_keys = 0;
+        {
+            persist::MappedFile file(persist::snapshot_path(data_dir));
+            if (file.ok()) {
+                persist::SnapshotHeader header;
+                if (file.size() < sizeof(header))
+                    throw std::string("truncated snapshot");
+                std::memcpy(&header, file.data(), sizeof(header));
+                if (std::memcmp(header.magic, persist::SNAP_MAGIC, sizeof(header.magic)) != 0 || header.version != persist::VERSION)
+                    throw std::string("bad snapshot file");
+                if (header.num_shards != static_cast<uint32_t>(num_shards))
+                    throw std::string("snapshot was written with --shards " + std::to_string(header.num_shards));
+
+                std::vector<persist::SnapshotShard> index(num_shards);
+                std::memcpy(index.data(), file.data() + sizeof(header), sizeof(persist::SnapshotShard) * num_shards);
+
+                auto load_shards = [&](int first, int step) {
+                    for (int s = first; s < num_shards; s += step) {
+                        if (shard_memory == 0) // with a budget, most of them may go straight to the spill file
+                            shards[s].post_counters.reserve(index[s].keys);
+                        const char *p = file.data() + index[s].offset;
+                        const char *end = p + index[s].bytes;
+                        while (p < end) {
+                            persist::SnapshotEntry e;
+                            std::memcpy(&e, p, sizeof(e));
+                            add_locked(shards[s], std::string_view(p + sizeof(e), e.key_len), e.value);
+                            p += sizeof(e) + e.key_len;
+                        }
+                        shards[s].seq = index[s].seq;
+                        snap_seq[s] = index[s].seq;
+                    }
+                };
+                int nthreads = std::min<int>(num_shards, std::max(1u, std::thread::hardware_concurrency()));
+                std::vector<std::thread> loaders;
+                for (int t = 0; t < nthreads; t++)
+                    loaders.emplace_back(load_shards, t, nthreads);
+                for (auto &t: loaders)
+                    t.join();
+
+                first_gen = header.wal_gen;
+                snap_keys = header.total_keys;
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        size_t replayed = 0;
+        uint64_t last_gen = first_gen;
+        for (uint64_t gen: persist::list_wal_gens(data_dir)) {
+            last_gen = std::max(last_gen, gen);
+            if (gen < first_gen)
+                continue; // covered by the snapshot, left over from a crash before deletion
+            persist::replay_wal(persist::wal_path(data_dir, gen), num_shards,
+                [&](uint32_t shard, uint64_t seq, std::string_view key, int delta) {
+                    if (seq <= snap_seq[shard])
+                        return;
+                    add_locked(shards[shard], key, delta);
+                    shards[shard].seq = seq;
+                    replayed++;
+                });
+        }
+        auto t2 = std::chrono::steady_clock::now();
+
+        // never append to a file that may end in a torn record
+        wal->open(last_gen + 1);
+
+        std::cout << "recovery: " << snap_keys << " keys from snapshot in "
+                  << std::chrono::duration<double>(t1 - t0).count() << " s, "
+                  << replayed << " log records replayed in "
+                  << std::chrono::duration<double>(t2 - t1).count() << " s, "
+                  << count_keys() << " keys total" << std::endl;
+    }
+
+    // ---- shared-nothing mode: loop i owns shards[i] and is the only thread touching it
+
+    int owner_of(std::string_view key) const {
+        return static_cast<int>(get_shard_index(key, num_threads));
+    }
+
+    void local_increment(EventLoop &loop, std::string_view key, int change) {
+        int gained;
+        ServerData &shard = shards[loop.id];
+        if (wal) {
+            // the log writer and snapshots still need to see a consistent shard
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            gained = add_locked(shard, key, change);
+            log_increment(loop.id, key, change);
+        } else {
+            // TOPK reads the heap from other loops; only lock when it changes
+            gained = add_locked(shard, key, key_hash(key), change, true);
+        }
+        stat_add(shards[loop.id].requests);
+        if (gained != 0)
+            loop.key_count.fetch_add(static_cast<size_t>(gained), std::memory_order_relaxed); // wraps for evictions
+    }
+
+    bool local_lookup(EventLoop &loop, std::string_view key, int &value) {
+        stat_add(shards[loop.id].requests);
+        return find_locked(shards[loop.id], key, key_hash(key), value);
+    }
+
+    // key (INC / GET) goes into the mailbox's key ring, so forwarding does not allocate.
+    void send_message(EventLoop &loop, int dst, Message &&msg, std::string_view key = {}) {
+        auto &backlog = loop.overflow[dst];
+        loop.notify[dst] = 1;
+        // keep FIFO order: once something is parked, everything after it is parked too
+        if (backlog.empty()) {
+            size_t box = loop.id * num_threads + dst;
+            uint64_t pos = 0;
+            char *p = key.empty() ? nullptr : mailbox_keys[box]->prepare(key.size(), pos);
+            if (p != nullptr) {
+                std::memcpy(p, key.data(), key.size());
+                msg.key_pos = pos;
+                msg.key_len = static_cast<uint32_t>(key.size());
+            }
+            if ((key.empty() || p != nullptr) && mailboxes[box]->push(std::move(msg))) {
+                if (p != nullptr)
+                    mailbox_keys[box]->commit(pos, key.size());
+                return;
+            }
+        }
+        msg.key_len = 0;
+        msg.own_key.assign(key.data(), key.size());
+        backlog.push_back(std::move(msg));
+    }
+
+    std::string_view message_key(const Message &msg, int src, int dst) const {
+        if (msg.key_len == 0)
+            return msg.own_key;
+        return {mailbox_keys[src * num_threads + dst]->at(msg.key_pos), msg.key_len};
+    }
+
+    void submit_shared_nothing(EventLoop &loop, Connection &conn, Command &cmd,
+                               std::chrono::steady_clock::time_point start) {
+        bool is_read = cmd.type == CommandType::GET || cmd.type == CommandType::MGET;
+        bool all_local = true;
+        if (is_read) {
+            for (const auto &key: cmd.keys) {
+                if (owner_of(key) != loop.id) {
+                    all_local = false;
+                    break;
+                }
+            }
+        }
+
+        // fast path: nothing to wait for and nothing queued in front of us
+        if (all_local && conn.pending.empty()) {
+            thread_local CommandResult res;
+            execute_owned(loop, conn, cmd, res, 0);
+            append_reply(cmd, res, conn.outbuf);
+            record_latency(cmd.type, start);
+            return;
+        }
+
+        PendingReply &slot = conn.pending.push_back();
+        slot.cmd.copy_owned(cmd); // outlives the input buffer contents
+        slot.start = start;
+        uint64_t seq = conn.pending_base + conn.pending.size() - 1;
+        slot.waiting = execute_owned(loop, conn, slot.cmd, slot.result, seq);
+        complete_ready(conn);
+    }
+
+    // Applies the locally owned part of cmd and forwards the rest.
+    // Returns the number of remote lookups whose results are still to come.
+    size_t execute_owned(EventLoop &loop, Connection &conn, const Command &cmd, CommandResult &res, uint64_t seq) {
+        size_t waiting = 0;
+        switch (cmd.type) {
+            case CommandType::INC:
+            case CommandType::MINC:
+                for (size_t i = 0; i < cmd.keys.size(); i++) {
+                    int owner = owner_of(cmd.keys[i]);
+                    if (owner == loop.id) {
+                        local_increment(loop, cmd.keys[i], cmd.changes[i]);
+                    } else {
+                        Message msg;
+                        msg.kind = Message::INC;
+                        msg.value = cmd.changes[i];
+                        send_message(loop, owner, std::move(msg), cmd.keys[i]);
+                    }
+                }
+                break;
+            case CommandType::GET:
+            case CommandType::MGET:
+                res.reset(cmd.keys.size());
+                for (size_t i = 0; i < cmd.keys.size(); i++) {
+                    int owner = owner_of(cmd.keys[i]);
+                    if (owner == loop.id) {
+                        res.found[i] = local_lookup(loop, cmd.keys[i], res.values[i]);
+                    } else {
+                        Message msg;
+                        msg.kind = Message::GET;
+                        msg.index = static_cast<uint32_t>(i);
+                        msg.conn_id = conn.id;
+                        msg.seq = seq;
+                        send_message(loop, owner, std::move(msg), cmd.keys[i]);
+                        waiting++;
+                    }
+                }
+                break;
+            case CommandType::STATS:
+                res.keys_total = count_keys();
+                res.evicted = count_evictions();
+                break;
+            case CommandType::STATS_DETAIL:
+                res.text = detail_stats();
+                break;
+            case CommandType::TOPK:
+                res.text = top_keys(cmd.changes[0]);
+                break;
+            default:
+                break;
+        }
+        return waiting;
+    }
+
+    // Moves finished replies from the head of the pending queue to outbuf.
+    void complete_ready(Connection &conn) {
+        while (!conn.pending.empty() && conn.pending.front().waiting == 0) {
+            append_reply(conn.pending.front().cmd, conn.pending.front().result, conn.outbuf);
+            record_latency(conn.pending.front().cmd.type, conn.pending.front().start);
+            conn.pending.pop_front();
+            conn.pending_base++;
+        }
+    }
+
+    void handle_message(EventLoop &loop, int src, Message &msg) {
+        switch (msg.kind) {
+            case Message::INC:
+                local_increment(loop, message_key(msg, src, loop.id), msg.value);
+                break;
+            case Message::GET: {
+                Message reply;
+                reply.kind = Message::VALUE;
+                reply.index = msg.index;
+                reply.conn_id = msg.conn_id;
+                reply.seq = msg.seq;
+                reply.found = local_lookup(loop, message_key(msg, src, loop.id), reply.value);
+                send_message(loop, src, std::move(reply));
+                break;
+            }
+            case Message::VALUE: {
+                auto it = loop.by_id.find(msg.conn_id);
+                if (it == loop.by_id.end())
+                    break; // client went away meanwhile
+                Connection &conn = *it->second;
+                PendingReply &slot = conn.pending[msg.seq - conn.pending_base];
+                slot.result.values[msg.index] = msg.value;
+                slot.result.found[msg.index] = msg.found;
+                slot.waiting--;
+                if (!conn.dirty) {
+                    conn.dirty = true;
+                    loop.dirty.push_back(conn.id);
+                }
+                break;
+            }
+        }
+    }
+
+    void drain_mailboxes(EventLoop &loop) {
+        Message msg;
+        for (int src = 0; src < num_threads; src++) {
+            if (src == loop.id)
+                continue;
+            auto &mailbox = *mailboxes[src * num_threads + loop.id];
+            uint64_t keys_end = 0;
+            for (int n = 0; n < mailbox_batch && mailbox.pop(msg); n++) {
+                handle_message(loop, src, msg);
+                if (msg.key_len > 0)
+                    keys_end = msg.key_pos + msg.key_len;
+            }
+            if (keys_end > 0)
+                mailbox_keys[src * num_threads + loop.id]->release(keys_end);
+        }
+
+        // flush connections that got results, once per iteration
+        for (uint64_t id: loop.dirty) {
+            auto it = loop.by_id.find(id);
+            if (it == loop.by_id.end())
+                continue;
+            Connection &conn = *it->second;
+            conn.dirty = false;
+            complete_ready(conn);
+            if (!flush_output(conn) || (conn.closing && conn.outbuf.empty() && conn.pending.empty()))
+                close_connection(loop, conn.fd);
+        }
+        loop.dirty.clear();
+    }
+
+    // Retries parked messages and wakes up every loop we sent something to.
+    void flush_mailboxes(EventLoop &loop) {
+        for (int dst = 0; dst < num_threads; dst++) {
+            auto &backlog = loop.overflow[dst];
+            auto &mailbox = *mailboxes[loop.id * num_threads + dst];
+            while (!backlog.empty() && mailbox.push(std::move(backlog.front()))) {
+                backlog.pop_front();
+            }
+            if (loop.notify[dst]) {
+                loop.notify[dst] = 0;
+                uint64_t one = 1;
+                ssize_t rc = write(loops[dst]->wake_fd, &one, sizeof(one));
+                (void)rc; // counter overflow is impossible in practice, EAGAIN means already signalled
+            }
+        }
+    }
+
+    bool has_backlog(const EventLoop &loop) const {
+        for (const auto &backlog: loop.overflow) {
+            if (!backlog.empty())
                 return true;
+        }
+        return false;
+    }
+
+    // ---- input parsing, shared by all modes
+
+    // Executes the complete commands already buffered and appends their replies to outbuf,
+    // so a pipelining client gets one send for the whole batch instead of one per command.
+    // At most conn_budget commands run per call, and none while max_output reply bytes wait
+    // (unless the peer is gone): one greedy client can not hold up the others of its loop.
+    // Returns true if complete commands were left for a later pass.
+    bool process_input(Connection &conn) {
+        if (conn.proto == Protocol::UNKNOWN && !conn.inbuf.empty()) {
+            if (static_cast<uint8_t>(conn.inbuf.view()[0]) == binproto::MAGIC) {
+                conn.proto = Protocol::BINARY;
+                conn.inbuf.consume(1);
+            } else {
+                conn.proto = Protocol::TEXT;
+            }
+        }
+
+        // commands waiting since before the cutoff are answered BUSY instead of executed
+        bool shedding = shed_after.count() > 0 && conn.input_since != std::chrono::steady_clock::time_point{} &&
+                        std::chrono::steady_clock::now() - conn.input_since > shed_after;
+        int budget = conn.peer_closed ? std::numeric_limits<int>::max() : conn_budget;
+        size_t shed_now = 0;
+        bool more = conn.proto == Protocol::BINARY ? process_binary_input(conn, budget, shedding, shed_now)
+                                                    : process_text_input(conn, budget, shedding, shed_now);
+        if (!more)
+            conn.input_since = {}; // only a partial command is left, its clock starts with the next recv
+        if (shed_now > 0)
+            shed.fetch_add(shed_now, std::memory_order_relaxed);
+        return more;
+    }
+
+    bool output_full(const Connection &conn) const {
+        return conn.outbuf.size() - conn.out_off >= max_output && !conn.peer_closed;
+    }
+
+    // Runs one parsed command, or only answers it while shedding.
+    void run_or_shed(Connection &conn, Command &cmd, bool shedding, size_t &shed_now) {
+        if (shedding && cmd.type != CommandType::QUIT) {
+            append_busy_reply(cmd, conn.outbuf);
+            shed_now++;
+            return;
+        }
+        submit(conn, cmd);
+    }
+
+    // Lines are parsed in place; the parsed prefix is dropped once per batch.
+    bool process_text_input(Connection &conn, int budget, bool shedding, size_t &shed_now) {
+        thread_local Command cmd; // reused, so parsing does not allocate
+        std::string_view data = conn.inbuf.view();
+        size_t start = 0;
+        bool more = false;
+        while (!conn.closing) {
+            const void *nl = std::memchr(data.data() + start, '\n', data.size() - start);
+            if (nl == nullptr)
+                break;
+            if (budget == 0 || output_full(conn)) {
+                more = true;
+                break;
+            }
+            size_t pos = static_cast<const char *>(nl) - data.data();
+            std::string_view line = data.substr(start, pos - start);
+            start = pos + 1;
+            if (!parse_text_command(line, cmd))
+                continue;
+            budget--;
+            run_or_shed(conn, cmd, shedding, shed_now);
+        }
+        conn.inbuf.consume(start);
+        return more;
+    }
+
+    bool process_binary_input(Connection &conn, int budget, bool shedding, size_t &shed_now) {
+        thread_local Command cmd;
+        std::string_view data = conn.inbuf.view();
+        size_t start = 0;
+        bool more = false;
+        while (!conn.closing && data.size() - start >= sizeof(binproto::RequestHeader)) {
+            binproto::RequestHeader h = binproto::read_header(data.data() + start);
+            if (h.key_len > binproto::MAX_KEY_LEN) {
+                // the stream can not be trusted anymore, answer and drop the client
+                binproto::append_reply(conn.outbuf, binproto::ST_ERROR);
+                conn.closing = true;
+                break;
+            }
+            size_t frame_len = sizeof(binproto::RequestHeader) + h.key_len;
+            if (data.size() - start < frame_len)
+                break; // wait for the rest of the frame
+            if (budget == 0 || output_full(conn)) {
+                more = true;
+                break;
+            }
+            const char *key_data = data.data() + start + sizeof(binproto::RequestHeader);
+            start += frame_len;
+            parse_binary_command(h, key_data, cmd);
+            budget--;
+            run_or_shed(conn, cmd, shedding, shed_now);
+        }
+        conn.inbuf.consume(start);
+        return more;
+    }
+
+    // Stamps newly received bytes for --shed-ms.
+    static void note_input(Connection &conn) {
+        conn.recent_input = true;
+        if (conn.input_since == std::chrono::steady_clock::time_point{})
+            conn.input_since = std::chrono::steady_clock::now();
+    }
+
+    // Run once a second by every loop: a connection that received nothing since the last
+    // sweep gives its (empty) input slab back, so idle clients hold no input memory.
+    // Returns true if a slab was freed.
+    static bool sweep_idle_input(Connection &conn) {
+        bool freed = !conn.recent_input && conn.inbuf.allocated() && conn.inbuf.empty();
+        if (freed)
+            conn.inbuf.release();
+        conn.recent_input = false;
+        return freed;
+    }
+
+    // A buffer full of input that holds no complete command: the command can never fit.
+    bool oversized_command(const Connection &conn, bool more) {
+        if (more || conn.inbuf.size() < max_input)
+            return false;
+        shed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Writes as much of outbuf as the socket accepts, handling partial writes.
+    // On a non-blocking socket leftovers are sent on the next EPOLLOUT edge.
+    bool flush_output(Connection &conn) {
+        while (conn.out_off < conn.outbuf.size()) {
+            ssize_t n = ::send(conn.fd, conn.outbuf.data() + conn.out_off,
+                               conn.outbuf.size() - conn.out_off, MSG_NOSIGNAL);
+            if (n >= 0) {
+                conn.out_off += n;
+                continue;
             }
-            char tmp[4096];
-            ssize_t n = ::recv(fd, tmp, sizeof(tmp), 0);
-            if (n == 0) return false; // peer closed
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            return false;
+        }
+        conn.outbuf.clear();
+        conn.out_off = 0;
+        return true;
+    }
+
+    // Blocking sends bound the output by themselves, so budgets here only decide
+    // how often replies are flushed.
+    void handle_client(int client_socket) {
+        Connection conn;
+        conn.fd = client_socket;
+
+        while(!terminate_flag && !conn.closing) {
+            char *dst = conn.inbuf.prepare();
+            ssize_t n = ::recv(client_socket, dst, std::min(conn.inbuf.space(), max_input - conn.inbuf.size()), 0);
+            if (n == 0) 
+                break; // peer closed
             if (n < 0) {
                 if (errno == EINTR) continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
                 perror("recv");
+                break;
+            }
+            conn.inbuf.commit(n);
+            note_input(conn);
+
+            bool more;
+            do {
+                more = process_input(conn);
+                flush_combined(); // before the replies, so acknowledged INCs are visible to all
+                if (!flush_output(conn))
+                    goto done;
+            } while (more && !conn.closing);
+            if (oversized_command(conn, more))
+                break;
+        }
+    done:
+        flush_combined();
+    }
+
+    // ---- event-loop (epoll) mode
+
+    // Accepts every pending connection on the (non-blocking) listener.
+    void accept_clients(EventLoop &loop, bool verbose) {
+        while (true) {
+            sockaddr_in cli{}; socklen_t clilen = sizeof(cli);
+            int fd = accept4(loop.listen_fd, reinterpret_cast<sockaddr*>(&cli), &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return; // another loop took it, or drained
+                if (errno == EMFILE || errno == ENFILE) {
+                    perror("accept4 (out of file descriptors)");
+                    return;
+                }
+                perror("accept4");
+                return;
+            }
+
+            if (verbose) {
+                char ip[INET_ADDRSTRLEN]{};
+                ::inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip));
+                std::cerr << "Accepted connection from " << ip << ":" << ntohs(cli.sin_port) << "\n";
+            }
+
+            // replies of one batch may leave in several sends (remote results arrive later),
+            // Nagle would hold them back until the client's delayed ACK
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            auto conn = std::make_unique<Connection>();
+            conn->fd = fd;
+            conn->id = loop.next_conn_id++;
+            if (shared_nothing)
+                conn->loop = &loop;
+
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn.get();
+            if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                perror("epoll_ctl(ADD client)");
+                close(fd);
+                continue;
+            }
+            loop.by_id.emplace(conn->id, conn.get());
+            loop.conns.emplace(fd, std::move(conn));
+        }
+    }
+
+    // Reads until EAGAIN (required by edge-triggered mode) or until max_input bytes are
+    // buffered, straight into the connection's buffer. Returns false on a socket error.
+    bool read_available(Connection &conn) {
+        conn.read_paused = false;
+        while (true) {
+            if (conn.inbuf.size() >= max_input) {
+                conn.read_paused = true; // no new edge will come for what is left, resume from the ready list
+                return true;
+            }
+            char *dst = conn.inbuf.prepare();
+            ssize_t n = ::recv(conn.fd, dst, std::min(conn.inbuf.space(), max_input - conn.inbuf.size()), 0);
+            if (n > 0) {
+                conn.inbuf.commit(n);
+                note_input(conn);
+                continue;
+            }
+            if (n == 0) {
+                conn.peer_closed = true;
+                return true;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            return false;
+        }
+    }
+
+    // Handles one readiness notification, or resumes a connection from the ready list
+    // (events == 0). Returns false when the connection must be closed.
+    bool service_connection(EventLoop &loop, Connection &conn, uint32_t events) {
+        if (events & EPOLLERR)
+            return false;
+
+        if (!conn.peer_closed && ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || conn.read_paused)) {
+            if (!read_available(conn))
                 return false;
+        }
+        bool more = process_input(conn);
+        // after EOF every buffered command ran above (no budget once the peer is gone); a client
+        // that only half-closed still gets the replies, so close as after QUIT once they are out
+        if (conn.peer_closed)
+            conn.closing = true;
+        if (!flush_output(conn))
+            return false;
+
+        if (conn.closing && conn.outbuf.empty() && conn.pending.empty())
+            return false;
+        if (oversized_command(conn, more))
+            return false;
+        // out of budget, or input left in the socket: another pass after the other connections.
+        // With the output full, the EPOLLOUT edge resumes it instead, as it does a closing one.
+        if ((more || conn.read_paused) && !conn.closing && !output_full(conn)) {
+            if (!conn.ready) {
+                conn.ready = true;
+                loop.ready.push_back(conn.id);
             }
-            buf.append(tmp, tmp + n);
+            deferred.fetch_add(1, std::memory_order_relaxed);
         }
+        return true;
     }
 
-    void reply_client(int client_socket, const std::string &reply) {
-        send(client_socket, reply.c_str(), reply.size(), 0);
+    void close_connection(EventLoop &loop, int fd) {
+        epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        auto it = loop.conns.find(fd);
+        if (it != loop.conns.end()) {
+            loop.by_id.erase(it->second->id);
+            loop.conns.erase(it);
+        }
     }
 
-    void handle_client(int client_socket, std::thread::id tid) {
-        std::string inbuf;
-        std::string command;
+    void epoll_worker(EventLoop &loop, bool verbose) {
+        std::thread::id tid = std::this_thread::get_id();
+        std::cout << "Event loop " << loop.id << " created, Thread ID: " << tid << std::endl;
+
+        if (shared_nothing)
+            pin_to_cpu(loop.id);
+
+        // In shared-nothing mode every loop has its own SO_REUSEPORT listener and the kernel
+        // spreads connections. Otherwise all loops watch the shared listener, and
+        // EPOLLEXCLUSIVE wakes only one of them per connection.
+        epoll_event lev{};
+        lev.events = shared_nothing ? EPOLLIN : (EPOLLIN | EPOLLEXCLUSIVE);
+        lev.data.ptr = nullptr; // nullptr marks the listening socket
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.listen_fd, &lev) < 0) {
+            throw std::string("Can not add listener to epoll");
+        }
+        if (shared_nothing) {
+            epoll_event wev{};
+            wev.events = EPOLLIN;
+            wev.data.ptr = &loop; // marks the wake-up eventfd
+            if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wake_fd, &wev) < 0) {
+                throw std::string("Can not add eventfd to epoll");
+            }
+        }
+
+        std::vector<epoll_event> events(max_events);
+        auto next_sweep = std::chrono::steady_clock::now() + std::chrono::seconds(1);
 
         while(!terminate_flag) {
-            if (!read_line(client_socket, command, inbuf)) 
-                break;
-            if (command.empty()) 
-                continue;
+            // timeout so that Ctrl+C is noticed even when idle; parked messages are retried soon
+            int timeout = !loop.ready.empty() ? 0 : (shared_nothing && has_backlog(loop)) ? 1 : 200;
+            int n = epoll_wait(loop.epfd, events.data(), max_events, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::string("epoll_wait failed");
+            }
+
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    accept_clients(loop, verbose);
+                    continue;
+                }
+                if (events[i].data.ptr == &loop) {
+                    uint64_t cnt;
+                    ssize_t rc = read(loop.wake_fd, &cnt, sizeof(cnt));
+                    (void)rc;
+                    continue;
+                }
+                Connection &conn = *static_cast<Connection*>(events[i].data.ptr);
+                if (!service_connection(loop, conn, events[i].events)) {
+                    close_connection(loop, conn.fd);
+                }
+            }
+
+            // one more budget for every connection deferred in an earlier pass
+            thread_local std::vector<uint64_t> resume;
+            resume.swap(loop.ready);
+            loop.ready.clear();
+            for (uint64_t id: resume) {
+                auto it = loop.by_id.find(id);
+                if (it == loop.by_id.end())
+                    continue; // closed meanwhile
+                Connection &conn = *it->second;
+                conn.ready = false;
+                if (!service_connection(loop, conn, 0))
+                    close_connection(loop, conn.fd);
+            }
+
+            if (shared_nothing) {
+                drain_mailboxes(loop);
+                flush_mailboxes(loop);
+            }
+            flush_combined();
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_sweep) {
+                bool freed = false;
+                for (auto &[fd, conn]: loop.conns)
+                    freed |= sweep_idle_input(*conn);
+                if (freed)
+                    malloc_trim(0); // slabs sit between live objects, the heap top alone would keep them
+                next_sweep = now + std::chrono::seconds(1);
+            }
+        }
+        flush_combined();
+
+        for (auto &[fd, conn]: loop.conns) {
+            close(fd);
+        }
+        close(loop.epfd);
+        if (loop.listen_fd != server_fd)
+            close(loop.listen_fd);
+        if (loop.wake_fd >= 0)
+            close(loop.wake_fd);
+    }
+
+    // ---- io_uring mode: same parsing and execution, completions instead of readiness
+
+    enum UringOp : uint64_t { OP_ACCEPT = 0, OP_RECV = 1, OP_SEND = 2, OP_CANCEL = 3 };
+    static constexpr uint64_t OP_MASK = 7;
+
+    static uint64_t uring_tag(UringConn *c, UringOp op) {
+        return reinterpret_cast<uint64_t>(c) | op;
+    }
+
+    static io_uring_sqe *uring_sqe(uring::Ring &ring) {
+        io_uring_sqe *sqe = ring.get_sqe();
+        if (sqe == nullptr)
+            throw std::string("io_uring submission queue full");
+        return sqe;
+    }
+
+    // Starts a send of everything replied so far, unless one is already in flight.
+    void uring_start_send(uring::Ring &ring, UringConn &c) {
+        if (c.send_active || c.shut)
+            return;
+        if (c.send_off == c.sending.size()) {
+            if (c.conn.outbuf.empty())
+                return;
+            c.sending.swap(c.conn.outbuf);
+            c.conn.outbuf.clear();
+            c.send_off = 0;
+        }
+        uring::prep_send(uring_sqe(ring), c.conn.fd, c.sending.data() + c.send_off,
+                         c.sending.size() - c.send_off, uring_tag(&c, OP_SEND));
+        c.send_active = true;
+    }
+
+    // Shutting the socket down ends the armed recv, and the cancel covers a recv waiting for buffers.
+    void uring_shutdown(uring::Ring &ring, UringConn &c) {
+        if (c.shut)
+            return;
+        c.shut = true;
+        ::shutdown(c.conn.fd, SHUT_RDWR);
+        if (c.recv_active)
+            uring::prep_cancel(uring_sqe(ring), uring_tag(&c, OP_RECV), uring_tag(nullptr, OP_CANCEL));
+    }
+
+    void uring_worker(int id, int listen_fd, bool verbose) {
+        std::thread::id tid = std::this_thread::get_id();
+        std::cout << "io_uring loop " << id << " created, Thread ID: " << tid << std::endl;
+
+        // completions are only reaped by this thread, let the kernel defer its work until we wait
+        uring::Ring ring;
+        // (6.1+); older kernels reject the flags in io_uring_setup, before anything is mapped
+        if (ring.init(uring_entries, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) < 0 &&
+            ring.init(uring_entries) < 0)
+            throw std::string("io_uring_setup failed");
+        uring::BufferRing bufs;
+        if (bufs.init(ring, 0, uring_buffers, uring_buf_size) < 0)
+            throw std::string("Can not register io_uring buffer ring");
+
+        std::unordered_map<UringConn*, std::unique_ptr<UringConn>> conns;
+        std::vector<UringConn*> to_send; // got replies during this batch of completions
+        std::vector<UringConn*> ready;   // work left after their pass, round-robin
+        uint64_t next_conn_id = 1;
+
+        uring::prep_multishot_accept(uring_sqe(ring), listen_fd, uring_tag(nullptr, OP_ACCEPT));
+
+        auto arm_recv = [&](UringConn &c) {
+            uring::prep_multishot_recv(uring_sqe(ring), c.conn.fd, bufs.group(), uring_tag(&c, OP_RECV));
+            c.recv_active = true;
+        };
+        auto queue_send = [&](UringConn &c) {
+            if (!c.queued) {
+                c.queued = true;
+                to_send.push_back(&c);
+            }
+        };
+        auto mark_ready = [&](UringConn &c) {
+            if (!c.conn.ready) {
+                c.conn.ready = true;
+                ready.push_back(&c);
+            }
+        };
+        auto can_free = [](const UringConn &c) {
+            return c.shut && !c.recv_active && !c.send_active && !c.queued && !c.conn.ready;
+        };
+
+        // One budgeted pass over the buffered commands. A full input buffer cancels the
+        // multishot recv, so the socket buffer and then the client's window fill up instead.
+        auto serve = [&](UringConn &c) {
+            bool more = process_input(c.conn);
+            queue_send(c);
+            if (oversized_command(c.conn, more)) {
+                uring_shutdown(ring, c);
+                return;
+            }
+            bool full = c.conn.inbuf.size() >= max_input;
+            if (full && c.recv_active && !c.recv_paused) {
+                c.recv_paused = true;
+                uring::prep_cancel(uring_sqe(ring), uring_tag(&c, OP_RECV), uring_tag(nullptr, OP_CANCEL));
+            } else if (!full && c.recv_paused) {
+                c.recv_paused = false;
+                if (!c.recv_active)
+                    arm_recv(c);
+            }
+            // with the output full, the send completion resumes it
+            if ((more || c.recv_paused) && !output_full(c.conn)) {
+                mark_ready(c);
+                deferred.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        auto on_accept = [&](const io_uring_cqe &cqe) {
+            if (!(cqe.flags & IORING_CQE_F_MORE) && !terminate_flag)
+                uring::prep_multishot_accept(uring_sqe(ring), listen_fd, uring_tag(nullptr, OP_ACCEPT));
+            if (cqe.res < 0) {
+                if (cqe.res != -ECANCELED)
+                    std::cerr << "accept: " << strerror(-cqe.res) << std::endl;
+                return;
+            }
+            if (verbose)
+                std::cerr << "Accepted connection, fd " << cqe.res << "\n";
+            int one = 1;
+            setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            auto c = std::make_unique<UringConn>();
+            c->conn.fd = cqe.res;
+            c->conn.id = next_conn_id++;
+            arm_recv(*c);
+            conns.emplace(c.get(), std::move(c));
+        };
+
+        auto on_recv = [&](UringConn &c, const io_uring_cqe &cqe) {
+            if (cqe.res > 0) {
+                uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (!c.shut) {
+                    c.conn.inbuf.append(bufs.data(bid), static_cast<size_t>(cqe.res));
+                    note_input(c.conn);
+                }
+                bufs.recycle(bid);
+                if (!c.shut && !c.conn.ready) // a deferred connection waits for its turn
+                    serve(c);
+            }
+            if (cqe.flags & IORING_CQE_F_MORE)
+                return;
+            c.recv_active = false;
+            if (c.shut)
+                return;
+            if (c.recv_paused)
+                return; // our cancel, or it ended by itself meanwhile: serve() re-arms it
+            // ENOBUFS: every provided buffer was in use, re-arm now that some came back
+            if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+                arm_recv(c);
+                return;
+            }
+            // peer closed or error: the buffered commands still run, and a client that only
+            // half-closed still gets their replies; the send loop below shuts the socket down
+            // once they are out, as after QUIT
+            c.conn.peer_closed = true;
+            process_input(c.conn);
+            c.conn.closing = true;
+            queue_send(c);
+        };
+
+        auto on_send = [&](UringConn &c, const io_uring_cqe &cqe) {
+            c.send_active = false;
+            if (cqe.res < 0) {
+                uring_shutdown(ring, c);
+                return;
+            }
+            c.send_off += static_cast<size_t>(cqe.res);
+            if (c.send_off == c.sending.size()) {
+                c.sending.clear();
+                c.send_off = 0;
+            }
+            queue_send(c); // the rest of a partial send, or replies gathered meanwhile
+            if (!c.shut && !c.conn.inbuf.empty())
+                mark_ready(c); // may have stopped at max_output
+        };
+
+        auto next_sweep = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (!terminate_flag) {
+            // timeout so that Ctrl+C is noticed even when idle, none while connections wait for their turn
+            int rc = ring.submit_and_wait(ready.empty() ? 200 : 0);
+            if (rc < 0 && rc != -ETIME && rc != -EINTR && rc != -EBUSY)
+                throw std::string("io_uring_enter failed: ") + strerror(-rc);
 
-            std::istringstream iss(command);
-            std::string cmd_name; 
-            iss >> cmd_name;
-
-            // super verbose
-            // std::cout << "tid " << tid << " recieved command " << cmd_name << std::endl;
-        
-            if(cmd_name == "QUIT") {
-                reply_client(client_socket, "BYE\n");
-            } else if (cmd_name == "STATS") {
-                std::ostringstream os;
-                
-                int sum_size = 0;
-                for(const auto &shard: shards) {
-                    sum_size += shard.post_counters.size();
+            ring.for_each_cqe([&](const io_uring_cqe &cqe) {
+                auto *c = reinterpret_cast<UringConn*>(cqe.user_data & ~OP_MASK);
+                switch (static_cast<UringOp>(cqe.user_data & OP_MASK)) {
+                    case OP_ACCEPT: on_accept(cqe); break;
+                    case OP_RECV: on_recv(*c, cqe); break;
+                    case OP_SEND: on_send(*c, cqe); break;
+                    default: return; // cancel results carry no state
                 }
-                os << "STATS post counters=" << sum_size << "\n";
-                reply_client(client_socket, os.str());
-            } else if (cmd_name == "INC") {
-                std::string key;
-                iss >> key;
-
-                int change = 1;
-                iss >> change;
-
-                // Hash key to determine which shard to use
-                size_t shard_idx = get_shard_index(key, num_shards);
-                {
-                    std::lock_guard<std::mutex> lock(shards[shard_idx].mtx);
-                    shards[shard_idx].post_counters[key] += change;
-                    shards[shard_idx].requests++;
+                if (c != nullptr && can_free(*c)) {
+                    close(c->conn.fd);
+                    conns.erase(c);
+                }
+            });
+
+            thread_local std::vector<UringConn*> resume;
+            resume.swap(ready);
+            ready.clear();
+            for (UringConn *c: resume) {
+                c->conn.ready = false;
+                if (!c->shut)
+                    serve(*c);
+                if (can_free(*c)) {
+                    close(c->conn.fd);
+                    conns.erase(c);
                 }
+            }
+
+            flush_combined(); // the replies below acknowledge these INCs
 
-                reply_client(client_socket, "OK\n");
-            } else if (cmd_name == "GET") {
-                std::string key;
-                iss >> key;
-
-                std::string reply;
-                size_t shard_idx = get_shard_index(key, num_shards);
-                {
-                    std::lock_guard<std::mutex> lock(shards[shard_idx].mtx);
-                    auto it = shards[shard_idx].post_counters.find(key);
-                    if (it != shards[shard_idx].post_counters.end())
-                        reply = "VALUE " + std::to_string(it->second) + "\n";
-                    else
-                        reply = "key not found\n";
-                    shards[shard_idx].requests++;
+            // one send per connection for everything this batch produced, all submitted
+            // together with the next wait
+            for (UringConn *c: to_send) {
+                c->queued = false;
+                uring_start_send(ring, *c);
+                if (c->conn.closing && !c->send_active && c->conn.outbuf.empty())
+                    uring_shutdown(ring, *c);
+                if (can_free(*c)) {
+                    close(c->conn.fd);
+                    conns.erase(c);
                 }
+            }
+            to_send.clear();
 
-                reply_client(client_socket, reply);
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_sweep) {
+                bool freed = false;
+                for (auto &[ptr, c]: conns)
+                    freed |= sweep_idle_input(c->conn);
+                if (freed)
+                    malloc_trim(0);
+                next_sweep = now + std::chrono::seconds(1);
+            }
+        }
+
+        flush_combined();
+        for (auto &[ptr, c]: conns) {
+            close(c->conn.fd);
+        }
+        if (listen_fd != server_fd)
+            close(listen_fd);
+    }
+
+    void setup_event_loops() {
+        for (int i = 0; i < num_threads; i++) {
+            auto loop = std::make_unique<EventLoop>();
+            loop->id = i;
+            loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (loop->epfd < 0) {
+                throw std::string("Can not create epoll instance");
+            }
+            if (shared_nothing) {
+                loop->listen_fd = open_listener(port);
+                set_nonblocking(loop->listen_fd);
+                loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (loop->wake_fd < 0) {
+                    throw std::string("Can not create eventfd");
+                }
+                loop->overflow.resize(num_threads);
+                loop->notify.assign(num_threads, 0);
+                loop->key_count = shards[i].post_counters.size(); // recovered keys
             } else {
-                continue;
+                loop->listen_fd = server_fd;
+            }
+            loops.push_back(std::move(loop));
+        }
+
+        if (shared_nothing) {
+            for (int i = 0; i < num_threads * num_threads; i++) {
+                mailboxes.push_back(std::make_unique<SpscQueue<Message>>(mailbox_size));
+                mailbox_keys.push_back(std::make_unique<SpscByteRing>(mailbox_key_bytes));
             }
+            std::cout << "Shared-nothing: " << num_threads << " listeners bound to port " << port << std::endl;
         }
     }
 public:
-    Server(int threads, int port): num_shards(threads), num_threads(threads), shards(threads) {
+    // In shared-nothing mode every loop owns exactly one shard, so the shard count follows the threads.
+    explicit Server(const Settings &settings)
+        : port(settings.port), num_shards(settings.shared_nothing ? settings.num_threads : settings.num_shards),
+          num_threads(settings.num_threads), shared_nothing(settings.shared_nothing), shards(num_shards),
+          data_dir(settings.data_dir), sync_ms(settings.sync_ms), snapshot_secs(settings.snapshot_secs),
+          combine_keys(settings.shared_nothing ? 0 : settings.combine_keys),
+          topk_enabled(settings.topk_capacity > 0),
+          shard_memory(settings.shard_memory),
+          max_input(settings.max_input), max_output(settings.max_output), conn_budget(settings.conn_budget),
+          shed_after(settings.shed_ms) {
         // for now outside of class
         install_sigint_handler();
 
-        connect_to_socket(port);
+        if (topk_enabled) {
+            for (auto &shard: shards)
+                shard.topk = TopKeys(settings.topk_capacity);
+        }
+        if (!settings.spill_dir.empty()) {
+            ::mkdir(settings.spill_dir.c_str(), 0755);
+            for (int s = 0; s < num_shards; s++)
+                shards[s].spill = std::make_unique<SpillFile>(settings.spill_dir + "/spill." + std::to_string(s) + ".bin");
+        }
+
+        if (!data_dir.empty()) {
+            wal = std::make_unique<persist::WalFile>(data_dir, num_shards);
+            recover();
+        }
+
+        // shared-nothing loops open their own listeners
+        if (!shared_nothing)
+            connect_to_socket(port);
     }
 
     ~Server() {
@@ -219,75 +1914,205 @@ public:
                 std::cerr << "Accepted connection from " << ip << ":" << ntohs(cli.sin_port) << "\n";
             }
 
-            handle_client(client_socket, tid);
+            handle_client(client_socket);
             close(client_socket);
         }
     }
 
-    void run(bool verbose) {
+    void run(IoMode mode, bool verbose) {
         std::vector<std::thread> threads;
 
+        std::vector<std::thread> persist_threads;
+        if (wal) {
+            persist_threads.emplace_back(&Server::wal_worker, this);
+            if (snapshot_secs > 0)
+                persist_threads.emplace_back(&Server::snapshot_worker, this);
+        }
+
+        if (mode == IoMode::EPOLL) {
+            if (!shared_nothing)
+                set_nonblocking(server_fd);
+            setup_event_loops();
+        }
+
         for(int i = 0; i < this->num_threads; i++) {
-            threads.push_back(std::move(std::thread(&Server::thread_worker, this, verbose)));
+            if (mode == IoMode::EPOLL)
+                threads.push_back(std::thread(&Server::epoll_worker, this, std::ref(*loops[i]), verbose));
+            else if (mode == IoMode::URING)
+                // every ring gets its own SO_REUSEPORT listener, the kernel spreads connections
+                threads.push_back(std::thread(&Server::uring_worker, this, i, i == 0 ? server_fd : open_listener(port), verbose));
+            else
+                threads.push_back(std::thread(&Server::thread_worker, this, verbose));
         }
 
         for(auto &thread: threads) {
             thread.join();
         }
 
+        if (wal) {
+            {
+                std::lock_guard<std::mutex> lk(persist_mtx);
+                persist_stop = true;
+            }
+            persist_cv.notify_all();
+            for (auto &thread: persist_threads) {
+                thread.join();
+            }
+            // a fresh snapshot makes the next start a pure mmap load
+            take_snapshot();
+        }
+
         std::cout << "Master thread finished" << std::endl;
     }
 };
 
+// Parses the value following argv[i] as an int. Advances i on success.
+static bool read_int_option(int argc, char* argv[], int &i, int &value) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+        std::cerr << "Error: " << arg << " option requires an argument." << std::endl;
+        return false;
+    }
+    try {
+        value = std::stoi(argv[++i]); // Convert string to integer and advance index
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Error: Invalid number provided for " << arg << "." << std::endl;
+        return false;
+    } catch (const std::out_of_range& e) {
+        std::cerr << "Error: Number for " << arg << " out of range." << std::endl;
+        return false;
+    }
+    return true;
+}
+
 int load_cli_settings(Settings &settings, int argc, char* argv[]) {
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "-p" || arg == "--port") {
-            if (i + 1 < argc) { // Check if there's a next argument for the port number
-                try {
-                    settings.port = std::stoi(argv[++i]); // Convert string to integer and advance index
-                } catch (const std::invalid_argument& e) {
-                    std::cerr << "Error: Invalid port number provided." << std::endl;
-                    return 1; // Exit with error
-                } catch (const std::out_of_range& e) {
-                    std::cerr << "Error: Port number out of range." << std::endl;
-                    return 1; // Exit with error
-                }
-            } else {
-                std::cerr << "Error: --port option requires an argument." << std::endl;
-                return 1; // Exit with error
-            }
+            if (!read_int_option(argc, argv, i, settings.port))
+                return 1;
         } else if (arg == "-t" || arg == "--threads") {
-            if (i + 1 < argc) { // Check if there's a next argument for the port number
-                try {
-                    settings.num_threads = std::stoi(argv[++i]); // Convert string to integer and advance index
-                } catch (const std::invalid_argument& e) {
-                    std::cerr << "Error: Invalid port number provided." << std::endl;
-                    return 1; // Exit with error
-                } catch (const std::out_of_range& e) {
-                    std::cerr << "Error: Port number out of range." << std::endl;
-                    return 1; // Exit with error
-                }
+            if (!read_int_option(argc, argv, i, settings.num_threads))
+                return 1;
+        } else if (arg == "-s" || arg == "--shards") {
+            if (!read_int_option(argc, argv, i, settings.num_shards))
+                return 1;
+            if (settings.num_shards < 1) {
+                std::cerr << "Error: --shards must be >= 1." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-m" || arg == "--mode") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --mode option requires an argument." << std::endl;
+                return 1;
+            }
+            std::string mode = argv[++i];
+            if (mode == "blocking") {
+                settings.mode = IoMode::BLOCKING;
+            } else if (mode == "epoll") {
+                settings.mode = IoMode::EPOLL;
+            } else if (mode == "uring") {
+                settings.mode = IoMode::URING;
             } else {
-                std::cerr << "Error: --port option requires an argument." << std::endl;
-                return 1; // Exit with error
+                std::cerr << "Error: unknown mode " << mode << " (expected blocking, epoll or uring)." << std::endl;
+                return 1;
             }
+        } else if (arg == "--shared-nothing") {
+            settings.shared_nothing = true;
+            settings.mode = IoMode::EPOLL;
+        } else if (arg == "--data-dir") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --data-dir option requires an argument." << std::endl;
+                return 1;
+            }
+            settings.data_dir = argv[++i];
+        } else if (arg == "--sync-ms") {
+            if (!read_int_option(argc, argv, i, settings.sync_ms))
+                return 1;
+        } else if (arg == "--snapshot-secs") {
+            if (!read_int_option(argc, argv, i, settings.snapshot_secs))
+                return 1;
+        } else if (arg == "--shard-memory") {
+            int mb;
+            if (!read_int_option(argc, argv, i, mb))
+                return 1;
+            if (mb < 0) {
+                std::cerr << "Error: --shard-memory must be >= 0." << std::endl;
+                return 1;
+            }
+            settings.shard_memory = static_cast<size_t>(mb) << 20;
+        } else if (arg == "--spill-dir") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --spill-dir option requires an argument." << std::endl;
+                return 1;
+            }
+            settings.spill_dir = argv[++i];
+        } else if (arg == "--max-input" || arg == "--max-output") {
+            int kb;
+            if (!read_int_option(argc, argv, i, kb))
+                return 1;
+            if (kb < 4) {
+                std::cerr << "Error: " << arg << " must be at least 4 (KB)." << std::endl;
+                return 1;
+            }
+            (arg == "--max-input" ? settings.max_input : settings.max_output) = static_cast<size_t>(kb) << 10;
+        } else if (arg == "--conn-budget") {
+            if (!read_int_option(argc, argv, i, settings.conn_budget))
+                return 1;
+            if (settings.conn_budget < 1) {
+                std::cerr << "Error: --conn-budget must be >= 1." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--shed-ms") {
+            if (!read_int_option(argc, argv, i, settings.shed_ms))
+                return 1;
+        } else if (arg == "--topk-capacity") {
+            if (!read_int_option(argc, argv, i, settings.topk_capacity))
+                return 1;
+        } else if (arg == "--combine") {
+            if (!read_int_option(argc, argv, i, settings.combine_keys))
+                return 1;
+        } else if (arg == "-q" || arg == "--quiet") {
+            settings.verbose = false;
+        } else if (arg == "-h" || arg == "--help") {
+            std::cout << "Usage: counter_server [--port P] [--threads N] [--shards N] [--mode blocking|epoll|uring] [--shared-nothing]\n"
+                      << "                      [--data-dir DIR] [--sync-ms MS] [--snapshot-secs S] [--combine KEYS]\n"
+                      << "                      [--topk-capacity N] [--shard-memory MB] [--spill-dir DIR]\n"
+                      << "                      [--max-input KB] [--max-output KB] [--conn-budget N] [--shed-ms MS] [--quiet]\n";
+            std::exit(0);
         }
-    }   
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
     try {
-        Settings settings = {.port = 9000, .verbose = true, .num_threads = 4};
+        Settings settings;
 
-        load_cli_settings(settings, argc, argv);
+        if (load_cli_settings(settings, argc, argv) != 0)
+            return 1;
 
-        Server server(settings.num_threads, settings.port);
-        server.run(settings.verbose);
+        raise_fd_limit();
+
+        if (settings.shared_nothing && settings.mode != IoMode::EPOLL) {
+            std::cerr << "Error: --shared-nothing requires the epoll mode." << std::endl;
+            return 1;
+        }
+
+        if (settings.mode == IoMode::URING) {
+            std::string reason = uring::unsupported_reason();
+            if (!reason.empty()) {
+                std::cerr << "io_uring unavailable (" << reason << "), falling back to epoll." << std::endl;
+                settings.mode = IoMode::EPOLL;
+            }
+        }
+
+        Server server(settings);
+        server.run(settings.mode, settings.verbose);
     } catch (const std::string &error) {
         std::cout << "Got critical error " << error << ", aborting..." << std::endl;
     }
     
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bump allocator for keys that do not fit inline. Blocks never move, so pointers
+// stay valid across table resizes; memory is only returned when the arena dies.
+class KeyArena {
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    std::vector<std::unique_ptr<char[]>> large_; // keys bigger than a quarter block
+    size_t used_ {BLOCK_SIZE}; // bytes used in blocks_.back(), forces a block on first use
+    size_t bytes_ {0};
+
+public:
+    const char* store(std::string_view key) {
+        char* p;
+        if (key.size() > BLOCK_SIZE / 4) {
+            large_.push_back(std::make_unique<char[]>(key.size()));
+            p = large_.back().get();
+            bytes_ += key.size();
+        } else {
+            if (used_ + key.size() > BLOCK_SIZE) {
+                blocks_.push_back(std::make_unique<char[]>(BLOCK_SIZE));
+                used_ = 0;
+                bytes_ += BLOCK_SIZE;
+            }
+            p = blocks_.back().get() + used_;
+            used_ += key.size();
+        }
+        std::memcpy(p, key.data(), key.size());
+        return p;
+    }
+
+    size_t bytes() const { return bytes_; }
+
+    KeyArena() = default;
+    KeyArena(KeyArena&&) = default;
+    KeyArena& operator=(KeyArena&&) = default;
+
+    // Forgets every key but keeps one block for reuse.
+    void clear() {
+        if (blocks_.size() > 1) blocks_.resize(1);
+        large_.clear();
+        used_ = blocks_.empty() ? BLOCK_SIZE : 0;
+        bytes_ = blocks_.empty() ? 0 : BLOCK_SIZE;
+    }
+};
+
+// Open-addressing hash table from string keys to int counters, SwissTable style:
+// one control byte per slot holds 7 bits of the hash, and a group of 16 control
+// bytes is matched with a single SSE2 compare. Slots store the full hash and keys
+// of up to INLINE_KEY bytes inline, so a hit usually touches one control line and one slot.
+//
+// Growing never rehashes everything at once: a bigger table is allocated and every
+// mutation migrates a few groups from the old one. Lookups check both tables meanwhile.
+//
+// For eviction under a memory budget every slot carries a CLOCK reference bit (the top
+// bit of its length), set when the key is added or found and cleared by the hand.
+class FlatCounterMap {
+public:
+    static constexpr size_t INLINE_KEY = 16;
+
+private:
+    static constexpr size_t GROUP = 16;
+    static constexpr uint8_t EMPTY = 0x80;
+    static constexpr uint8_t DELETED = 0xFE;
+    static constexpr size_t MIGRATE_GROUPS = 2; // old groups moved per mutation while resizing
+
+    static constexpr uint32_t REFERENCED = 1u << 31;
+
+    struct Slot {
+        uint64_t hash;
+        uint32_t len;  // key length | REFERENCED
+        int value;
+        union {
+            char inline_key[INLINE_KEY];
+            const char* ptr; // arena, when the key is longer than INLINE_KEY
+        } key;
+
+        size_t key_len() const { return len & ~REFERENCED; }
+        std::string_view view() const {
+            size_t n = key_len();
+            return {n <= INLINE_KEY ? key.inline_key : key.ptr, n};
+        }
+        void touch() {
+            if ((len & REFERENCED) == 0) len |= REFERENCED; // no store on the common path
+        }
+    };
+    static_assert(sizeof(Slot) == 32, "two slots per cache line");
+
+    struct Table {
+        std::unique_ptr<uint8_t[]> ctrl;
+        std::unique_ptr<Slot[]> slots;
+        size_t capacity {0}; // multiple of GROUP, power of two
+        size_t used {0};     // full + deleted
+        size_t size {0};     // full
+
+        explicit Table(size_t cap = 0) : capacity(cap) {
+            if (cap == 0) return;
+            ctrl = std::make_unique<uint8_t[]>(cap);
+            slots = std::make_unique<Slot[]>(cap);
+            std::memset(ctrl.get(), EMPTY, cap);
+        }
+        size_t group_mask() const { return capacity / GROUP - 1; }
+    };
+
+    Table cur_;
+    Table old_;               // non-empty while a resize is in progress
+    size_t migrate_group_ {0}; // next old group to move
+    KeyArena arena_;
+    size_t key_bytes_ {0};     // arena bytes of live keys
+    size_t hand_ {0};          // CLOCK position over old_ then cur_
+
+    static bool is_full(uint8_t c) { return (c & 0x80) == 0; }
+
+    // fmix64: the caller's hash also picks the shard, so its low bits are not random inside one table
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static uint8_t h2(uint64_t h) { return static_cast<uint8_t>(h >> 57); }
+    static size_t h1(uint64_t h) { return static_cast<size_t>(h); }
+
+    // Bit i set if ctrl[i] == c, for the 16 control bytes at p.
+    static uint32_t match(const uint8_t* p, uint8_t c) {
+#if defined(__SSE2__)
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(c)))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP; i++)
+            mask |= static_cast<uint32_t>(p[i] == c) << i;
+        return mask;
+#endif
+    }
+
+    // Bit i set if ctrl[i] is EMPTY or DELETED (high bit set).
+    static uint32_t match_free(const uint8_t* p) {
+#if defined(__SSE2__)
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP; i++)
+            mask |= static_cast<uint32_t>(p[i] >> 7) << i;
+        return mask;
+#endif
+    }
+
+    static Slot* find_in(const Table& t, uint64_t h, std::string_view key) {
+        if (t.capacity == 0) return nullptr;
+        size_t mask = t.group_mask();
+        size_t g = h1(h) & mask;
+        for (size_t step = 1; ; step++) {
+            const uint8_t* ctrl = t.ctrl.get() + g * GROUP;
+            for (uint32_t m = match(ctrl, h2(h)); m != 0; m &= m - 1) {
+                Slot& s = t.slots[g * GROUP + __builtin_ctz(m)];
+                if (s.hash == h && s.view() == key)
+                    return &s;
+            }
+            if (match(ctrl, EMPTY) != 0)
+                return nullptr;
+            if (step > mask) // visited every group
+                return nullptr;
+            g = (g + step) & mask; // triangular probing covers all groups
+        }
+    }
+
+    // Places a key known to be absent; the table must have a free slot.
+    static Slot& insert_in(Table& t, uint64_t h) {
+        size_t mask = t.group_mask();
+        size_t g = h1(h) & mask;
+        for (size_t step = 1; ; step++) {
+            uint8_t* ctrl = t.ctrl.get() + g * GROUP;
+            uint32_t m = match_free(ctrl);
+            if (m != 0) {
+                size_t i = g * GROUP + __builtin_ctz(m);
+                if (t.ctrl[i] == EMPTY) t.used++;
+                t.ctrl[i] = h2(h);
+                t.size++;
+                return t.slots[i];
+            }
+            g = (g + step) & mask;
+        }
+    }
+
+    void erase_slot(Table& t, Slot* s) {
+        size_t i = static_cast<size_t>(s - t.slots.get());
+        t.ctrl[i] = DELETED;
+        t.size--;
+    }
+
+    // For keys leaving the map: their arena bytes become garbage, which is dropped by
+    // copying the live long keys into a fresh arena once it is half their size.
+    void forget_key(const Slot& s) {
+        if (s.key_len() <= INLINE_KEY)
+            return;
+        key_bytes_ -= s.key_len();
+        if (arena_.bytes() > key_bytes_ + key_bytes_ / 2 + (256u << 10))
+            compact_keys();
+    }
+
+    void compact_keys() {
+        KeyArena fresh;
+        for (Table* t : {&old_, &cur_}) {
+            for (size_t i = 0; i < t->capacity; i++) {
+                Slot& s = t->slots[i];
+                if (is_full(t->ctrl[i]) && s.key_len() > INLINE_KEY)
+                    s.key.ptr = fresh.store(s.view());
+            }
+        }
+        arena_ = std::move(fresh);
+    }
+
+    void migrate_step(size_t groups) {
+        size_t num_groups = old_.capacity / GROUP;
+        for (size_t n = 0; n < groups && migrate_group_ < num_groups; n++, migrate_group_++) {
+            for (size_t i = migrate_group_ * GROUP; i < (migrate_group_ + 1) * GROUP; i++) {
+                if (is_full(old_.ctrl[i])) {
+                    insert_in(cur_, old_.slots[i].hash) = old_.slots[i];
+                    old_.ctrl[i] = DELETED;
+                    old_.size--;
+                }
+            }
+        }
+        if (migrate_group_ == num_groups) {
+            old_ = Table();
+            migrate_group_ = 0;
+        }
+    }
+
+    void maybe_grow() {
+        if (cur_.used + 1 <= cur_.capacity / 8 * 7)
+            return;
+        if (old_.capacity != 0)
+            migrate_step(old_.capacity / GROUP); // previous resize still running, finish it now
+        if (cur_.used + 1 <= cur_.capacity / 8 * 7)
+            return;
+        // mostly tombstones: rebuild at the same size, otherwise double
+        size_t new_cap = cur_.size * 2 >= cur_.capacity ? cur_.capacity * 2 : cur_.capacity;
+        old_ = std::move(cur_);
+        cur_ = Table(new_cap);
+        migrate_group_ = 0;
+    }
+
+public:
+    explicit FlatCounterMap(size_t initial_capacity = 64) {
+        size_t cap = GROUP;
+        while (cap < initial_capacity) cap <<= 1;
+        cur_ = Table(cap);
+    }
+
+    // Sizes an empty table for n keys, e.g. before loading a snapshot.
+    void reserve(size_t n) {
+        if (size() != 0) return;
+        size_t cap = GROUP;
+        while (cap / 8 * 7 < n) cap <<= 1;
+        if (cap > cur_.capacity) cur_ = Table(cap);
+    }
+
+    // Removes every entry, keeping the current capacity.
+    void clear() {
+        old_ = Table();
+        migrate_group_ = 0;
+        std::memset(cur_.ctrl.get(), EMPTY, cur_.capacity);
+        cur_.used = 0;
+        cur_.size = 0;
+        arena_.clear();
+        key_bytes_ = 0;
+        hand_ = 0;
+    }
+
+    FlatCounterMap(FlatCounterMap&&) = default;
+    FlatCounterMap& operator=(FlatCounterMap&&) = default;
+
+    // Adds delta to key, creating it at 0 first, and stores the new value in total.
+    // Returns true if the key was inserted.
+    bool add(std::string_view key, uint64_t hash, int delta, int& total) {
+        uint64_t h = mix(hash);
+        if (old_.capacity != 0)
+            migrate_step(MIGRATE_GROUPS);
+        if (Slot* s = find_in(cur_, h, key)) {
+            s->value += delta;
+            s->touch();
+            total = s->value;
+            return false;
+        }
+        if (old_.capacity != 0) {
+            if (Slot* s = find_in(old_, h, key)) {
+                // move it over now, so it is only ever updated in one place
+                Slot moved = *s;
+                erase_slot(old_, s);
+                moved.value += delta;
+                moved.touch();
+                total = moved.value;
+                maybe_grow();
+                insert_in(cur_, h) = moved;
+                return false;
+            }
+        }
+
+        maybe_grow();
+        Slot& s = insert_in(cur_, h);
+        s.hash = h;
+        s.len = static_cast<uint32_t>(key.size()) | REFERENCED;
+        s.value = delta;
+        total = delta;
+        if (key.size() <= INLINE_KEY) {
+            std::memcpy(s.key.inline_key, key.data(), key.size());
+        } else {
+            s.key.ptr = arena_.store(key);
+            key_bytes_ += key.size();
+        }
+        return true;
+    }
+
+    bool add(std::string_view key, uint64_t hash, int delta) {
+        int total;
+        return add(key, hash, delta, total);
+    }
+
+    bool add(std::string_view key, int delta) {
+        return add(key, std::hash<std::string_view>{}(key), delta);
+    }
+
+    // Also marks the key as recently used.
+    bool find(std::string_view key, uint64_t hash, int& value) {
+        uint64_t h = mix(hash);
+        Slot* s = find_in(cur_, h, key);
+        if (s == nullptr && old_.capacity != 0)
+            s = find_in(old_, h, key);
+        if (s == nullptr)
+            return false;
+        s->touch();
+        value = s->value;
+        return true;
+    }
+
+    bool find(std::string_view key, int& value) {
+        return find(key, std::hash<std::string_view>{}(key), value);
+    }
+
+    // Removes key. The bytes of a long key stay in the arena.
+    bool erase(std::string_view key, uint64_t hash) {
+        uint64_t h = mix(hash);
+        if (Slot* s = find_in(cur_, h, key)) {
+            erase_slot(cur_, s);
+            forget_key(*s);
+            return true;
+        }
+        if (old_.capacity != 0) {
+            if (Slot* s = find_in(old_, h, key)) {
+                erase_slot(old_, s);
+                forget_key(*s);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // CLOCK: sweeps the slots, clearing reference bits, and removes the first key that
+    // was not used since the hand last passed it, after calling f(key, value) on it.
+    // Amortized O(1) slots per eviction; false if the map is empty.
+    template <typename F>
+    bool evict_one(F&& f) {
+        if (size() == 0)
+            return false;
+        while (true) {
+            size_t total = old_.capacity + cur_.capacity;
+            if (hand_ >= total) hand_ = 0;
+            bool in_old = hand_ < old_.capacity;
+            Table& t = in_old ? old_ : cur_;
+            size_t i = in_old ? hand_ : hand_ - old_.capacity;
+            hand_++;
+            if (!is_full(t.ctrl[i]))
+                continue;
+            Slot& s = t.slots[i];
+            if (s.len & REFERENCED) {
+                s.len &= ~REFERENCED;
+                continue;
+            }
+            f(s.view(), s.value);
+            erase_slot(t, &s);
+            forget_key(s);
+            return true;
+        }
+    }
+
+    bool erase(std::string_view key) {
+        return erase(key, std::hash<std::string_view>{}(key));
+    }
+
+    size_t size() const { return cur_.size + old_.size; }
+
+    size_t memory_bytes() const {
+        return (cur_.capacity + old_.capacity) * (sizeof(Slot) + 1) + arena_.bytes();
+    }
+
+    // What the live keys need, with the table at most half full: unlike memory_bytes()
+    // it shrinks with every removal, so a budget can be enforced key by key.
+    size_t live_bytes() const {
+        return size() * 2 * (sizeof(Slot) + 1) + key_bytes_;
+    }
+
+    // Calls f(std::string_view key, int value) for every entry.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const Table* t : {&old_, &cur_}) {
+            for (size_t i = 0; i < t->capacity; i++) {
+                if (is_full(t->ctrl[i]))
+                    f(t->slots[i].view(), t->slots[i].value);
+            }
+        }
+    }
+};
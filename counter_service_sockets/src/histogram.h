@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Single-writer statistic counter: the owner updates it with a plain load + store
+// (no locked instruction), readers on other threads get a torn-free relaxed load.
+inline void stat_add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// HDR-style log-linear histogram of nanosecond latencies: every power of two is split
+// into 16 linear sub-buckets, so any recorded value is off by at most ~6%.
+// One writer thread; readers merge concurrently.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int MAX_BITS = 40; // ~18 minutes in ns, larger values are clamped
+    static constexpr int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB;
+
+    static int bucket_of(uint64_t v) {
+        if (v < SUB) return static_cast<int>(v);
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS) return BUCKETS - 1;
+        int sub = static_cast<int>((v >> (msb - SUB_BITS)) & (SUB - 1));
+        return (msb - SUB_BITS + 1) * SUB + sub;
+    }
+
+    // Upper bound of the values that land in bucket b.
+    static uint64_t bucket_limit(int b) {
+        if (b < SUB) return static_cast<uint64_t>(b);
+        int msb = b / SUB + SUB_BITS - 1;
+        uint64_t sub = static_cast<uint64_t>(b % SUB);
+        return ((SUB + sub + 1) << (msb - SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t ns) {
+        stat_add(counts_[bucket_of(ns)]);
+    }
+
+    void merge_into(std::vector<uint64_t> &total) const {
+        total.resize(BUCKETS, 0);
+        for (int b = 0; b < BUCKETS; b++)
+            total[b] += counts_[b].load(std::memory_order_relaxed);
+    }
+
+    // q in [0, 1], on merged counts. Returns 0 for an empty histogram.
+    static uint64_t percentile(const std::vector<uint64_t> &counts, double q) {
+        uint64_t total = 0;
+        for (uint64_t c: counts) total += c;
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts.size(); b++) {
+            seen += counts[b];
+            if (seen >= rank) return bucket_limit(static_cast<int>(b));
+        }
+        return bucket_limit(BUCKETS - 1);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_ {};
+};
+
+// One set of N histograms per thread, created on the thread's first record and kept
+// after it exits, so recording never takes a lock and never shares a cache line.
+template <size_t N>
+class ThreadHistograms {
+    using Set = std::array<Histogram, N>;
+
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Set>> sets_;
+
+public:
+    Histogram &local(size_t series) {
+        thread_local Set *set = nullptr; // one registry per process in this program
+        if (set == nullptr) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            sets_.push_back(std::make_unique<Set>());
+            set = sets_.back().get();
+        }
+        return (*set)[series];
+    }
+
+    std::vector<uint64_t> merged(size_t series) {
+        std::vector<uint64_t> total(Histogram::BUCKETS, 0);
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (const auto &set: sets_)
+            (*set)[series].merge_into(total);
+        return total;
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+// Receive buffer of one connection. recv() writes straight into the free tail and the
+// parser reads complete commands in place, as string_views into the buffer. Consumed
+// bytes only advance an offset; the unparsed rest is moved to the front when the tail
+// runs short, so each byte is moved at most once instead of once per parsed line.
+// The slab is allocated by the first prepare() and only grows for a command larger than
+// itself. release() hands an empty one back, so an idle connection holds no slab.
+class InputBuffer {
+    std::unique_ptr<char[]> data_;
+    size_t initial_;
+    size_t capacity_ {0};
+    size_t begin_ {0}; // first unparsed byte
+    size_t end_ {0};   // one past the last received byte
+
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 16 * 1024;
+
+    explicit InputBuffer(size_t capacity = DEFAULT_CAPACITY) : initial_(capacity) {}
+
+    std::string_view view() const { return {data_.get() + begin_, end_ - begin_}; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+
+    // Drops n parsed bytes from the front.
+    void consume(size_t n) {
+        begin_ += n;
+        if (begin_ == end_)
+            begin_ = end_ = 0;
+    }
+
+    // Makes room for at least min_space bytes after the data and returns where they go.
+    // Invalidates views into the buffer.
+    char *prepare(size_t min_space = 4096) {
+        if (!data_) {
+            size_t cap = initial_;
+            while (cap < min_space) cap *= 2;
+            data_ = std::make_unique<char[]>(cap);
+            capacity_ = cap;
+        }
+        if (capacity_ - end_ >= min_space)
+            return data_.get() + end_;
+        size_t used = end_ - begin_;
+        if (capacity_ - used >= min_space) {
+            std::memmove(data_.get(), data_.get() + begin_, used);
+        } else {
+            size_t cap = capacity_ * 2;
+            while (cap - used < min_space) cap *= 2;
+            auto bigger = std::make_unique<char[]>(cap);
+            std::memcpy(bigger.get(), data_.get() + begin_, used);
+            data_ = std::move(bigger);
+            capacity_ = cap;
+        }
+        begin_ = 0;
+        end_ = used;
+        return data_.get() + end_;
+    }
+
+    size_t space() const { return capacity_ - end_; }
+
+    // Marks n bytes written at prepare() as received.
+    void commit(size_t n) { end_ += n; }
+
+    void append(const char *p, size_t n) {
+        std::memcpy(prepare(n), p, n);
+        commit(n);
+    }
+
+    // Frees the slab if nothing is buffered; the next prepare() allocates a fresh one.
+    void release() {
+        if (!empty() || !data_)
+            return;
+        data_.reset();
+        capacity_ = 0;
+        begin_ = end_ = 0;
+    }
+
+    bool allocated() const { return data_ != nullptr; }
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk state of counter_server: a write-ahead log of INC operations and
+// periodic snapshots of all shards.
+//
+// Every shard numbers its INCs with its own sequence (seq), assigned under the shard lock.
+// A snapshot stores, per shard, the seq of the last INC it contains, so replay just skips
+// log records with seq <= that value. No global log lock or LSN is needed.
+//
+// Log files are named wal.<gen>.log. Taking a snapshot first rotates the log to a new
+// generation, so every older generation is fully covered by the snapshot and can be deleted.
+// Snapshots and logs record the shard count; a restart must use the same --shards.
+namespace persist {
+
+struct WalRecord {
+    uint64_t seq;
+    uint32_t shard;
+    int32_t delta;
+    uint32_t key_len;
+};
+static_assert(sizeof(WalRecord) == 24, "WalRecord layout is part of the file format");
+
+struct WalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_shards;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_shards;
+    uint64_t wal_gen;    // first log generation not covered by this snapshot
+    uint64_t total_keys;
+};
+
+// Followed by the entries of one shard: { int32 value; uint32 key_len; key bytes }.
+struct SnapshotShard {
+    uint64_t seq;    // last INC of this shard included
+    uint64_t offset; // from the start of the file
+    uint64_t bytes;
+    uint64_t keys;
+};
+
+struct SnapshotEntry {
+    int32_t value;
+    uint32_t key_len;
+};
+
+constexpr char WAL_MAGIC[8] = {'C', 'N', 'T', 'W', 'A', 'L', '0', '1'};
+constexpr char SNAP_MAGIC[8] = {'C', 'N', 'T', 'S', 'N', 'P', '0', '1'};
+constexpr uint32_t VERSION = 1;
+
+inline void append_wal_record(std::string& buf, uint32_t shard, uint64_t seq, std::string_view key, int delta) {
+    WalRecord r{seq, shard, delta, static_cast<uint32_t>(key.size())};
+    buf.append(reinterpret_cast<const char*>(&r), sizeof(r));
+    buf.append(key.data(), key.size());
+}
+
+inline void append_snapshot_entry(std::string& buf, std::string_view key, int value) {
+    SnapshotEntry e{value, static_cast<uint32_t>(key.size())};
+    buf.append(reinterpret_cast<const char*>(&e), sizeof(e));
+    buf.append(key.data(), key.size());
+}
+
+inline std::string wal_path(const std::string& dir, uint64_t gen) {
+    return dir + "/wal." + std::to_string(gen) + ".log";
+}
+
+inline std::string snapshot_path(const std::string& dir) {
+    return dir + "/snapshot.bin";
+}
+
+inline bool write_fully(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+inline bool pwrite_fully(int fd, const void* p, size_t n, off_t off) {
+    const char* c = static_cast<const char*>(p);
+    while (n > 0) {
+        ssize_t w = ::pwrite(fd, c, n, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        c += w;
+        n -= static_cast<size_t>(w);
+        off += w;
+    }
+    return true;
+}
+
+inline void fsync_dir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+// Log generations present in dir, ascending.
+inline std::vector<uint64_t> list_wal_gens(const std::string& dir) {
+    std::vector<uint64_t> gens;
+    DIR* d = ::opendir(dir.c_str());
+    if (d == nullptr) return gens;
+    while (dirent* e = ::readdir(d)) {
+        unsigned long long gen;
+        char tail[8];
+        if (std::sscanf(e->d_name, "wal.%llu.%4s", &gen, tail) == 2 && std::strcmp(tail, "log") == 0)
+            gens.push_back(gen);
+    }
+    ::closedir(d);
+    std::sort(gens.begin(), gens.end());
+    return gens;
+}
+
+// Read-only mapping of a whole file.
+class MappedFile {
+    const char* data_ {nullptr};
+    size_t size_ {0};
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char*>(p);
+                size_ = st.st_size;
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() {
+        if (data_ != nullptr) ::munmap(const_cast<char*>(data_), size_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool ok() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// Calls f(shard, seq, key, delta) for every complete record. A torn tail (crash in the
+// middle of a write) ends the replay. Throws std::string on a log from another shard count.
+inline size_t replay_wal(const std::string& path, uint32_t num_shards,
+                         const std::function<void(uint32_t, uint64_t, std::string_view, int)>& f) {
+    MappedFile file(path);
+    if (!file.ok() || file.size() < sizeof(WalHeader)) return 0;
+    WalHeader h;
+    std::memcpy(&h, file.data(), sizeof(h));
+    if (std::memcmp(h.magic, WAL_MAGIC, sizeof(h.magic)) != 0 || h.version != VERSION)
+        throw std::string("bad log file " + path);
+    if (h.num_shards != num_shards)
+        throw std::string(path + " was written with --shards " + std::to_string(h.num_shards));
+
+    size_t records = 0;
+    size_t off = sizeof(WalHeader);
+    while (off + sizeof(WalRecord) <= file.size()) {
+        WalRecord r;
+        std::memcpy(&r, file.data() + off, sizeof(r));
+        if (r.shard >= num_shards || off + sizeof(r) + r.key_len > file.size())
+            break;
+        f(r.shard, r.seq, std::string_view(file.data() + off + sizeof(r), r.key_len), r.delta);
+        off += sizeof(r) + r.key_len;
+        records++;
+    }
+    return records;
+}
+
+// Append-only log file of the current generation. Callers serialize access.
+class WalFile {
+    std::string dir_;
+    uint32_t num_shards_;
+    int fd_ {-1};
+    uint64_t gen_ {0};
+
+public:
+    WalFile(std::string dir, uint32_t num_shards) : dir_(std::move(dir)), num_shards_(num_shards) {}
+    ~WalFile() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    uint64_t gen() const { return gen_; }
+
+    // Starts generation gen (a fresh file, never appended to after a crash).
+    void open(uint64_t gen) {
+        if (fd_ >= 0) {
+            ::fdatasync(fd_);
+            ::close(fd_);
+        }
+        gen_ = gen;
+        std::string path = wal_path(dir_, gen);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::string("Can not open log file " + path);
+        WalHeader h{};
+        std::memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+        h.version = VERSION;
+        h.num_shards = num_shards_;
+        if (!write_fully(fd_, reinterpret_cast<const char*>(&h), sizeof(h)) || ::fdatasync(fd_) != 0)
+            throw std::string("Can not write log file " + path);
+        fsync_dir(dir_);
+    }
+
+    // Group commit: one write and one fdatasync for everything gathered since the last call.
+    bool commit(const std::string& data) {
+        if (data.empty()) return true;
+        if (!write_fully(fd_, data.data(), data.size())) {
+            perror("write(wal)");
+            return false;
+        }
+        if (::fdatasync(fd_) != 0) {
+            perror("fdatasync(wal)");
+            return false;
+        }
+        return true;
+    }
+};
+
+} // namespace persist
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Where a shard's evicted keys go (--spill-dir): an open-addressing table of fixed
+// 64-byte records in a file mapped MAP_SHARED. The kernel writes dirty pages back and
+// drops cold ones from the page cache, so spilled keys cost disk rather than RAM and
+// finding one costs at most a page fault. Values add up, so the in-memory count and the
+// spilled one of a key can simply be summed. Keys longer than MAX_KEY are not spilled.
+// Not synchronized; the shard's owner serializes access. Errors throw std::string.
+class SpillFile {
+public:
+    static constexpr size_t MAX_KEY = 50;
+
+private:
+    static constexpr uint8_t EMPTY = 0; // a fresh (sparse) file reads as all empty
+    static constexpr uint8_t FULL = 1;
+    static constexpr uint8_t DELETED = 2;
+    static constexpr size_t INITIAL_CAPACITY = 4096;
+
+    struct Record {
+        uint64_t hash;
+        int32_t value;
+        uint8_t state;
+        uint8_t len;
+        char key[MAX_KEY];
+
+        std::string_view view() const { return {key, len}; }
+    };
+    static_assert(sizeof(Record) == 64, "one record per cache line");
+
+    std::string path_;
+    int fd_ {-1};
+    Record* recs_ {nullptr};
+    size_t capacity_ {0}; // power of two
+    size_t used_ {0};     // full + deleted
+    size_t size_ {0};     // full
+
+    // fmix64, the shard hash's low bits are the same for every key of a shard
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static uint64_t hash_of(std::string_view key) { return mix(std::hash<std::string_view>{}(key)); }
+
+    static std::pair<int, Record*> map_file(const std::string& path, size_t capacity) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::string("Can not open spill file " + path);
+        size_t bytes = capacity * sizeof(Record);
+        if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+            ::close(fd);
+            throw std::string("Can not size spill file " + path);
+        }
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::string("Can not map spill file " + path);
+        }
+        ::madvise(p, bytes, MADV_RANDOM);
+        return {fd, static_cast<Record*>(p)};
+    }
+
+    void unmap() {
+        if (recs_ != nullptr) ::munmap(recs_, capacity_ * sizeof(Record));
+        if (fd_ >= 0) ::close(fd_);
+        recs_ = nullptr;
+        fd_ = -1;
+    }
+
+    Record* find_record(std::string_view key, uint64_t h) const {
+        size_t mask = capacity_ - 1;
+        for (size_t i = h & mask; recs_[i].state != EMPTY; i = (i + 1) & mask) {
+            Record& r = recs_[i];
+            if (r.state == FULL && r.hash == h && r.view() == key)
+                return &r;
+        }
+        return nullptr;
+    }
+
+    // Slot for a key known to be absent.
+    Record& insert_record(uint64_t h) {
+        size_t mask = capacity_ - 1;
+        size_t i = h & mask;
+        while (recs_[i].state == FULL) i = (i + 1) & mask;
+        if (recs_[i].state == EMPTY) used_++;
+        size_++;
+        return recs_[i];
+    }
+
+    // Rewrites the table into a new file: bigger when mostly full, same size when mostly tombstones.
+    void rebuild() {
+        size_t cap = capacity_;
+        while ((size_ + 1) * 4 > cap) cap *= 2;
+        std::string tmp = path_ + ".tmp";
+        auto [fd, recs] = map_file(tmp, cap);
+        Record* old = recs_;
+        size_t old_cap = capacity_;
+        int old_fd = fd_;
+        recs_ = recs;
+        fd_ = fd;
+        capacity_ = cap;
+        used_ = size_ = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].state == FULL)
+                insert_record(old[i].hash) = old[i];
+        }
+        ::munmap(old, old_cap * sizeof(Record));
+        ::close(old_fd);
+        if (::rename(tmp.c_str(), path_.c_str()) != 0)
+            throw std::string("Can not rename spill file " + tmp);
+    }
+
+public:
+    explicit SpillFile(std::string path) : path_(std::move(path)), capacity_(INITIAL_CAPACITY) {
+        std::tie(fd_, recs_) = map_file(path_, capacity_);
+    }
+    ~SpillFile() {
+        unmap();
+        ::unlink(path_.c_str()); // rebuilt on every start, from the snapshot if there is one
+    }
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // Adds value to key's spilled count. False if the key is too long to spill.
+    bool add(std::string_view key, int value) {
+        if (key.size() > MAX_KEY)
+            return false;
+        uint64_t h = hash_of(key);
+        if (Record* r = find_record(key, h)) {
+            r->value += value;
+            return true;
+        }
+        if ((used_ + 1) * 2 > capacity_)
+            rebuild();
+        Record& r = insert_record(h);
+        r.hash = h;
+        r.value = value;
+        r.state = FULL;
+        r.len = static_cast<uint8_t>(key.size());
+        std::memcpy(r.key, key.data(), key.size());
+        return true;
+    }
+
+    bool find(std::string_view key, int& value) const {
+        if (size_ == 0 || key.size() > MAX_KEY)
+            return false;
+        const Record* r = find_record(key, hash_of(key));
+        if (r == nullptr)
+            return false;
+        value = r->value;
+        return true;
+    }
+
+    // Removes key, for when it comes back into memory.
+    bool take(std::string_view key, int& value) {
+        if (size_ == 0 || key.size() > MAX_KEY)
+            return false;
+        Record* r = find_record(key, hash_of(key));
+        if (r == nullptr)
+            return false;
+        value = r->value;
+        r->state = DELETED;
+        size_--;
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    // Calls f(std::string_view key, int value) for every spilled key.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (size_t i = 0; i < capacity_; i++) {
+            if (recs_[i].state == FULL)
+                f(recs_[i].view(), recs_[i].value);
+        }
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Bounded lock-free single-producer / single-consumer ring.
+// Head and tail live on separate cache lines, and each side caches the other's
+// index so that the shared line is only read when the ring looks full / empty.
+template <typename T>
+class SpscQueue {
+    std::vector<T> slots_;
+    size_t mask_;
+
+    alignas(64) std::atomic<size_t> head_ {0}; // next slot to pop, written by the consumer
+    size_t cached_tail_ {0};
+
+    alignas(64) std::atomic<size_t> tail_ {0}; // next slot to push, written by the producer
+    size_t cached_head_ {0};
+
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        slots_.resize(cap);
+        mask_ = cap - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side. Returns false (and leaves val untouched) when the ring is full.
+    bool push(T &&val) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == slots_.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == slots_.size())
+                return false;
+        }
+        slots_[tail & mask_] = std::move(val);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool pop(T &out) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_)
+                return false;
+        }
+        out = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Bytes that travel with the messages of one SpscQueue, so a message can name its key by
+// position instead of owning a copy. The producer writes into prepare() and commits once the
+// message that names the bytes is pushed; the consumer releases them after handling it.
+// Both sides go in push order, so reserving bumps the tail and freeing bumps the head.
+// A run of bytes never wraps: when the end of the buffer is too short, it starts over at 0.
+class SpscByteRing {
+    std::unique_ptr<char[]> data_;
+    size_t size_;
+
+    alignas(64) std::atomic<uint64_t> head_ {0}; // first byte still in use, written by the consumer
+
+    alignas(64) uint64_t tail_ {0}; // producer only
+    uint64_t cached_head_ {0};
+
+public:
+    // size is rounded up to a power of two
+    explicit SpscByteRing(size_t size) {
+        size_t cap = 2;
+        while (cap < size) cap <<= 1;
+        size_ = cap;
+        data_ = std::make_unique<char[]>(cap);
+    }
+
+    SpscByteRing(const SpscByteRing&) = delete;
+    SpscByteRing& operator=(const SpscByteRing&) = delete;
+
+    // Producer side. Room for n bytes at position pos, or nullptr when the ring is full.
+    // Nothing is reserved until commit(pos, n).
+    char *prepare(size_t n, uint64_t &pos) {
+        pos = tail_;
+        size_t off = static_cast<size_t>(pos & (size_ - 1));
+        if (off + n > size_)
+            pos += size_ - off; // skip the short end
+        if (pos + n - cached_head_ > size_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (pos + n - cached_head_ > size_)
+                return nullptr;
+        }
+        return data_.get() + (pos & (size_ - 1));
+    }
+
+    void commit(uint64_t pos, size_t n) { tail_ = pos + n; }
+
+    // Consumer side. Visible once the message naming them was popped.
+    const char *at(uint64_t pos) const { return data_.get() + (pos & (size_ - 1)); }
+
+    // Frees every byte before end.
+    void release(uint64_t end) { head_.store(end, std::memory_order_release); }
+};
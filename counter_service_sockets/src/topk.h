@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Heaviest keys of one shard: a min-heap of the `capacity` keys it reports plus as many
+// again held in reserve, by count.
+// The shard map already knows every key's exact total, so each update passes the new
+// total instead of the delta, and the heap is a top-k of the shard rather than a
+// frequency estimate. A key that is not monitored can only enter by beating the
+// minimum, and the minimum only grows while counts only grow, so every unmonitored key
+// is at most the minimum: with increments alone the heap holds the exact top keys.
+// A decrement updates a monitored key in place and a dropped key is removed; neither
+// rescans the shard. The reserve is what covers them: a key that sinks below the reported
+// ones is replaced by the best reserve candidate in the next top(). A key that never got
+// into the heap only enters once its count changes and beats the minimum, so after
+// decrements or drops the answer can miss such a key: it is exact for increments only.
+// Cold keys cost one comparison against the minimum, and a fixed-size open-addressing
+// index maps keys to heap positions, so updates never allocate once the monitored keys
+// fit their strings' capacity.
+class TopKeys {
+public:
+    struct Item {
+        std::string key;
+        uint64_t hash {0};
+        int64_t count {0};
+        uint32_t slot {0}; // position in index_
+    };
+
+private:
+    std::vector<Item> heap_;
+    std::vector<int32_t> index_; // heap position, -1 = empty; linear probing
+    size_t capacity_; // keys reported
+    size_t monitored_; // keys in the heap: the reported ones and the reserve
+    int shift_;
+
+    size_t home(uint64_t hash) const {
+        return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ULL) >> shift_); // high bits, the shard used the low ones
+    }
+    size_t mask() const { return index_.size() - 1; }
+
+    void place(size_t pos) {
+        index_[heap_[pos].slot] = static_cast<int32_t>(pos);
+    }
+
+    void swap_items(size_t a, size_t b) {
+        std::swap(heap_[a], heap_[b]);
+        place(a);
+        place(b);
+    }
+
+    void sift_down(size_t pos) {
+        while (true) {
+            size_t l = 2 * pos + 1, r = l + 1, min = pos;
+            if (l < heap_.size() && heap_[l].count < heap_[min].count) min = l;
+            if (r < heap_.size() && heap_[r].count < heap_[min].count) min = r;
+            if (min == pos) return;
+            swap_items(pos, min);
+            pos = min;
+        }
+    }
+
+    void sift_up(size_t pos) {
+        while (pos > 0) {
+            size_t parent = (pos - 1) / 2;
+            if (heap_[parent].count <= heap_[pos].count) return;
+            swap_items(pos, parent);
+            pos = parent;
+        }
+    }
+
+    int32_t find(std::string_view key, uint64_t hash) const {
+        for (size_t i = home(hash); index_[i] >= 0; i = (i + 1) & mask()) {
+            const Item &item = heap_[index_[i]];
+            if (item.hash == hash && item.key == key)
+                return index_[i];
+        }
+        return -1;
+    }
+
+    // Index slot for a key known to be absent.
+    uint32_t claim_slot(uint64_t hash) {
+        size_t i = home(hash);
+        while (index_[i] >= 0) i = (i + 1) & mask();
+        return static_cast<uint32_t>(i);
+    }
+
+    // Backward-shift deletion keeps probe sequences intact without tombstones.
+    void release_slot(size_t i) {
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask();
+            if (index_[j] < 0) break;
+            size_t k = home(heap_[index_[j]].hash);
+            bool movable = (i <= j) ? (k <= i || k > j) : (k <= i && k > j);
+            if (movable) {
+                index_[i] = index_[j];
+                heap_[index_[i]].slot = static_cast<uint32_t>(i);
+                i = j;
+            }
+        }
+        index_[i] = -1;
+    }
+
+    bool full() const { return heap_.size() == monitored_; }
+
+public:
+    explicit TopKeys(size_t capacity = 128)
+        : capacity_(std::max<size_t>(capacity, 1)), monitored_(2 * capacity_) {
+        size_t slots = 2;
+        int bits = 1;
+        while (slots < monitored_ * 2) {
+            slots <<= 1;
+            bits++;
+        }
+        index_.assign(slots, -1);
+        shift_ = 64 - bits;
+        heap_.reserve(monitored_);
+    }
+
+    // True when update() would leave the heap as it is: a monitored key is never below
+    // the minimum unless it just decreased.
+    bool ignores(int64_t total, int64_t delta) const {
+        return delta == 0 || (delta > 0 && full() && total < heap_[0].count);
+    }
+
+    // key now has `total` after changing by `delta`.
+    void update(std::string_view key, uint64_t hash, int64_t total, int64_t delta) {
+        if (ignores(total, delta))
+            return;
+        int32_t pos = find(key, hash);
+        if (pos >= 0) {
+            heap_[pos].count = total;
+            if (delta > 0)
+                sift_down(static_cast<size_t>(pos));
+            else
+                sift_up(static_cast<size_t>(pos));
+            return;
+        }
+        if (delta <= 0 || total <= 0)
+            return;
+        if (!full()) {
+            heap_.emplace_back();
+            Item &item = heap_.back();
+            item.key.assign(key.data(), key.size());
+            item.hash = hash;
+            item.count = total;
+            item.slot = claim_slot(hash);
+            place(heap_.size() - 1);
+            sift_up(heap_.size() - 1);
+            return;
+        }
+        if (total == heap_[0].count)
+            return; // a tie does not displace the key already there
+        Item &min = heap_[0];
+        release_slot(min.slot);
+        min.key.assign(key.data(), key.size());
+        min.hash = hash;
+        min.count = total;
+        min.slot = claim_slot(hash);
+        place(0);
+        sift_down(0);
+    }
+
+    // Stops monitoring key. Returns true if it was monitored.
+    bool remove(std::string_view key, uint64_t hash) {
+        int32_t pos = find(key, hash);
+        if (pos < 0)
+            return false;
+        release_slot(heap_[pos].slot);
+        size_t last = heap_.size() - 1;
+        if (static_cast<size_t>(pos) != last) {
+            std::swap(heap_[pos], heap_[last]);
+            place(static_cast<size_t>(pos));
+        }
+        heap_.pop_back();
+        if (static_cast<size_t>(pos) < heap_.size()) {
+            sift_up(static_cast<size_t>(pos));
+            sift_down(static_cast<size_t>(pos));
+        }
+        return true;
+    }
+
+    // The n highest counts, highest first; never more than capacity, the reserve stays out.
+    std::vector<Item> top(size_t n) const {
+        std::vector<Item> items(heap_);
+        n = std::min({n, capacity_, items.size()});
+        std::partial_sort(items.begin(), items.begin() + n, items.end(),
+                          [](const Item &a, const Item &b) { return a.count > b.count; });
+        items.resize(n);
+        return items;
+    }
+};
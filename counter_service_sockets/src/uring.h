@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Minimal io_uring over the raw syscalls, so the server has no liburing dependency:
+// the submission / completion rings, provided buffer rings for multishot recv, and
+// the few request types the server uses. One thread per Ring.
+namespace uring {
+
+inline int sys_setup(unsigned entries, io_uring_params *p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+inline int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+inline int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+class Ring {
+    int fd_ {-1};
+    unsigned features_ {0};
+
+    void *sq_ptr_ {MAP_FAILED};
+    void *cq_ptr_ {MAP_FAILED};
+    size_t sq_len_ {0}, cq_len_ {0}, sqes_len_ {0};
+
+    unsigned *sq_head_ {nullptr}, *sq_tail_ {nullptr};
+    unsigned sq_mask_ {0}, sq_entries_ {0};
+    io_uring_sqe *sqes_ {static_cast<io_uring_sqe *>(MAP_FAILED)};
+    unsigned sqe_tail_ {0}; // filled locally, published to *sq_tail_ on submit
+
+    unsigned *cq_head_ {nullptr}, *cq_tail_ {nullptr};
+    unsigned cq_mask_ {0};
+    io_uring_cqe *cqes_ {nullptr};
+
+    void publish() {
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    }
+    unsigned unsubmitted() const {
+        return sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+public:
+    Ring() = default;
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    ~Ring() {
+        if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_len_);
+        if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+        if (sq_ptr_ != MAP_FAILED) munmap(sq_ptr_, sq_len_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Returns 0 or -errno.
+    int init(unsigned entries, unsigned flags = 0) {
+        io_uring_params p {};
+        p.flags = flags;
+        fd_ = sys_setup(entries, &p);
+        if (fd_ < 0)
+            return -errno;
+        features_ = p.features;
+
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (features_ & IORING_FEAT_SINGLE_MMAP)
+            sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+        sq_ptr_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED)
+            return -errno;
+        if (features_ & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr_ = sq_ptr_;
+        } else {
+            cq_ptr_ = mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED)
+                return -errno;
+        }
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(
+            mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED)
+            return -errno;
+
+        char *sq = static_cast<char *>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_entries_ = p.sq_entries;
+        sqe_tail_ = *sq_tail_;
+        // identity mapping, set once: slot i of the array always names sqes_[i]
+        unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++)
+            array[i] = i;
+
+        char *cq = static_cast<char *>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        return 0;
+    }
+
+    int fd() const { return fd_; }
+    unsigned features() const { return features_; }
+
+    // Next free submission entry, zeroed. Submits what is queued when the ring is full.
+    io_uring_sqe *get_sqe() {
+        if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            submit();
+            if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+                return nullptr;
+        }
+        io_uring_sqe *sqe = &sqes_[sqe_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe_tail_++;
+        return sqe;
+    }
+
+    int submit() {
+        publish();
+        unsigned n = unsubmitted();
+        if (n == 0)
+            return 0;
+        int rc = sys_enter(fd_, n, 0, 0, nullptr, 0);
+        return rc < 0 ? -errno : rc;
+    }
+
+    // Submits everything queued and waits for at least one completion or the timeout,
+    // all in one syscall. Returns -ETIME on timeout and -EINTR on a signal.
+    int submit_and_wait(int timeout_ms) {
+        publish();
+        __kernel_timespec ts {};
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        io_uring_getevents_arg arg {};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        int rc = sys_enter(fd_, unsubmitted(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        return rc < 0 ? -errno : rc;
+    }
+
+    // Calls f(const io_uring_cqe &) for every available completion and releases them.
+    template <typename F>
+    unsigned for_each_cqe(F &&f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned n = tail - head;
+        for (; head != tail; head++)
+            f(cqes_[head & cq_mask_]);
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return n;
+    }
+};
+
+// Provided buffer ring: the kernel picks a free buffer for every multishot recv
+// completion, the owner hands it back with recycle() once the bytes are consumed.
+class BufferRing {
+    Ring *ring_ {nullptr};
+    // The ring is an array of io_uring_buf whose first resv field doubles as the tail.
+    // Addressed by hand: in C++ the header's flex-array member lands at offset 8, not 0.
+    io_uring_buf *br_ {nullptr};
+    uint16_t *br_tail_ {nullptr};
+    size_t br_len_ {0};
+    char *data_ {nullptr};
+    size_t data_len_ {0};
+    unsigned entries_ {0};
+    unsigned buf_size_ {0};
+    uint16_t bgid_ {0};
+    uint16_t tail_ {0};
+
+    void add(uint16_t bid, unsigned offset) {
+        io_uring_buf &b = br_[(tail_ + offset) & (entries_ - 1)];
+        b.addr = reinterpret_cast<uint64_t>(data_ + static_cast<size_t>(bid) * buf_size_);
+        b.len = buf_size_;
+        b.bid = bid;
+    }
+
+public:
+    BufferRing() = default;
+    BufferRing(const BufferRing &) = delete;
+    BufferRing &operator=(const BufferRing &) = delete;
+
+    ~BufferRing() {
+        if (ring_ != nullptr) {
+            io_uring_buf_reg reg {};
+            reg.bgid = bgid_;
+            sys_register(ring_->fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        if (br_ != nullptr) munmap(br_, br_len_);
+        if (data_ != nullptr) munmap(data_, data_len_);
+    }
+
+    // entries must be a power of two (at most 32768). Returns 0 or -errno.
+    int init(Ring &ring, uint16_t bgid, unsigned entries, unsigned buf_size) {
+        entries_ = entries;
+        buf_size_ = buf_size;
+        bgid_ = bgid;
+        br_len_ = entries * sizeof(io_uring_buf);
+        void *p = mmap(nullptr, br_len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return -errno;
+        br_ = static_cast<io_uring_buf *>(p);
+        br_tail_ = &br_[0].resv;
+        data_len_ = static_cast<size_t>(entries) * buf_size;
+        p = mmap(nullptr, data_len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return -errno;
+        data_ = static_cast<char *>(p);
+
+        io_uring_buf_reg reg {};
+        reg.ring_addr = reinterpret_cast<uint64_t>(br_);
+        reg.ring_entries = entries;
+        reg.bgid = bgid;
+        if (sys_register(ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return -errno;
+        ring_ = &ring;
+
+        for (unsigned i = 0; i < entries; i++)
+            add(static_cast<uint16_t>(i), i);
+        tail_ = static_cast<uint16_t>(tail_ + entries);
+        __atomic_store_n(br_tail_, tail_, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    uint16_t group() const { return bgid_; }
+    const char *data(uint16_t bid) const { return data_ + static_cast<size_t>(bid) * buf_size_; }
+
+    void recycle(uint16_t bid) {
+        add(bid, 0);
+        tail_++;
+        __atomic_store_n(br_tail_, tail_, __ATOMIC_RELEASE);
+    }
+};
+
+// ---- request preparation
+
+inline void prep_multishot_accept(io_uring_sqe *sqe, int listen_fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+// Stays armed and completes once per chunk received, each in a buffer taken from group.
+inline void prep_multishot_recv(io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+inline void prep_send(io_uring_sqe *sqe, int fd, const char *data, size_t len, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+inline void prep_cancel(io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+// Empty when this kernel has everything the server needs, otherwise why not.
+inline std::string unsupported_reason() {
+    Ring ring;
+    int rc = ring.init(8);
+    if (rc < 0)
+        return std::string("io_uring_setup: ") + strerror(-rc);
+    if (!(ring.features() & IORING_FEAT_EXT_ARG))
+        return "kernel lacks IORING_FEAT_EXT_ARG (needs 5.11+)";
+
+    size_t probe_len = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+    std::string probe_buf(probe_len, '\0');
+    auto *probe = reinterpret_cast<io_uring_probe *>(probe_buf.data());
+    if (sys_register(ring.fd(), IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+        return std::string("IORING_REGISTER_PROBE: ") + strerror(errno);
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return "opcode " + std::to_string(op) + " not supported";
+    }
+
+    // provided buffer rings arrived together with multishot accept (5.19)
+    BufferRing bufs;
+    rc = bufs.init(ring, 0, 8, 64);
+    if (rc < 0)
+        return std::string("IORING_REGISTER_PBUF_RING: ") + strerror(-rc);
+
+    // multishot recv only came in 6.0: on 5.19 everything above works and then every recv
+    // completes with -EINVAL, so try one on a socketpair with a byte already waiting
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return std::string("socketpair: ") + strerror(errno);
+    int res = -ETIME;
+    if (::write(sv[1], "x", 1) == 1) {
+        prep_multishot_recv(ring.get_sqe(), sv[0], bufs.group(), 1);
+        rc = ring.submit_and_wait(1000);
+        ring.for_each_cqe([&](const io_uring_cqe &cqe) {
+            if (cqe.user_data == 1 && res == -ETIME)
+                res = cqe.res;
+        });
+        if (rc < 0 && rc != -ETIME)
+            res = rc;
+    } else {
+        res = -errno;
+    }
+    close(sv[0]);
+    close(sv[1]);
+    if (res < 0)
+        return std::string("multishot recv: ") + strerror(-res) + " (needs 6.0+)";
+    return "";
+}
+
+} // namespace uring
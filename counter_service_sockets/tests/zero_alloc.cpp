@@ -0,0 +1,290 @@
+// Runs pipelined text and binary INC/GET batches through Server::process_input with a
+// counting operator new and fails if a warmed-up pass allocates anything. In shared-nothing
+// mode the batch also goes through the mailboxes to the other loop and back.
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static long allocations = 0;
+static bool counting = false;
+
+static void *counted_alloc(std::size_t size, std::size_t align = 0) {
+    if (counting)
+        allocations++;
+    if (size == 0)
+        size = 1;
+    void *p = align > alignof(std::max_align_t) ? std::aligned_alloc(align, (size + align - 1) / align * align)
+                                                : std::malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size) { return counted_alloc(size); }
+void *operator new[](std::size_t size) { return counted_alloc(size); }
+void *operator new(std::size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<std::size_t>(al)); }
+void *operator new[](std::size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<std::size_t>(al)); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+#define main counter_server_main
+#include "../src/counter_server.cpp"
+#undef main
+
+struct ServerProbe {
+    static void run(Server &server, Connection &conn) {
+        while (server.process_input(conn)) {}
+        server.flush_combined();
+    }
+
+    // two loops without threads: conn belongs to loop 0
+    static void attach(Server &server, Connection &conn) {
+        server.setup_event_loops();
+        conn.loop = server.loops[0].get();
+        conn.id = conn.loop->next_conn_id++;
+        conn.loop->by_id.emplace(conn.id, &conn);
+    }
+
+    // One round trip through the mailboxes, as the two loops would do it; the replies end up in the socket.
+    static bool exchange(Server &server, Connection &conn) {
+        while (server.process_input(conn)) {}
+        EventLoop &local = *server.loops[0];
+        EventLoop &remote = *server.loops[1];
+        for (int round = 0; round < 4 && !conn.pending.empty(); round++) {
+            server.flush_mailboxes(local);
+            server.drain_mailboxes(remote);
+            server.flush_mailboxes(remote);
+            server.drain_mailboxes(local);
+        }
+        return conn.pending.empty() && server.flush_output(conn);
+    }
+
+    static int owner(const Server &server, std::string_view key) { return server.owner_of(key); }
+};
+
+static const int KEYS = 64;
+static const int PASSES = 100;
+
+static std::string text_batch() {
+    std::string batch;
+    for (int i = 0; i < KEYS; i++)
+        batch += "INC key" + std::to_string(i) + " 1\nGET key" + std::to_string(i) + "\n";
+    return batch;
+}
+
+static std::string binary_batch() {
+    std::string batch;
+    for (int i = 0; i < KEYS; i++) {
+        std::string key = "key" + std::to_string(i);
+        binproto::append_request(batch, binproto::OP_INC, key, 1);
+        binproto::append_request(batch, binproto::OP_GET, key);
+    }
+    return batch;
+}
+
+// 2 * KEYS reply lines, none of them an error
+static bool text_replies_ok(const std::string &out) {
+    return std::count(out.begin(), out.end(), '\n') == 2 * KEYS && out.find("ERR") == std::string::npos;
+}
+
+// 2 * KEYS reply frames, all ST_OK
+static bool binary_replies_ok(const std::string &out) {
+    if (out.size() != 2 * KEYS * sizeof(binproto::Reply))
+        return false;
+    for (size_t off = 0; off < out.size(); off += sizeof(binproto::Reply)) {
+        if (binproto::read_reply(out.data() + off).status != binproto::ST_OK)
+            return false;
+    }
+    return true;
+}
+
+// Feeds batch to conn PASSES times, the first ones uncounted; returns the allocations of the rest.
+static long steady_state_allocations(Server &server, Connection &conn, const std::string &batch,
+                                     bool (*replies_valid)(const std::string &), bool &replies_ok) {
+    replies_ok = true;
+    long before = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        if (pass == 2) {
+            before = allocations;
+            counting = true;
+        }
+        conn.inbuf.append(batch.data(), batch.size());
+        ServerProbe::run(server, conn);
+        if (!replies_valid(conn.outbuf) || !conn.inbuf.empty())
+            replies_ok = false;
+        conn.outbuf.clear();
+    }
+    counting = false;
+    return allocations - before;
+}
+
+static int check(const char *name, Settings settings) {
+    settings.port = 0;
+    settings.verbose = false;
+    Server server(settings);
+    int failures = 0;
+
+    std::string text = text_batch();
+    Connection text_conn;
+    bool ok;
+    long n = steady_state_allocations(server, text_conn, text, text_replies_ok, ok);
+    if (!ok) {
+        std::printf("FAIL %s text: wrong replies\n", name);
+        failures++;
+    }
+    text_conn.inbuf.append("GET key0\n", 9);
+    ServerProbe::run(server, text_conn);
+    std::string expect = "VALUE " + std::to_string(PASSES) + "\n";
+    if (text_conn.outbuf != expect) {
+        std::printf("FAIL %s text: expected %s, got %s", name, expect.c_str(), text_conn.outbuf.c_str());
+        failures++;
+    }
+    if (n != 0) {
+        std::printf("FAIL %s text: %ld allocations in %d steady-state passes\n", name, n, PASSES - 2);
+        failures++;
+    }
+
+    std::string binary(1, static_cast<char>(binproto::MAGIC));
+    Connection bin_conn;
+    bin_conn.inbuf.append(binary.data(), binary.size());
+    n = steady_state_allocations(server, bin_conn, binary_batch(), binary_replies_ok, ok);
+    if (!ok) {
+        std::printf("FAIL %s binary: wrong replies\n", name);
+        failures++;
+    }
+    if (n != 0) {
+        std::printf("FAIL %s binary: %ld allocations in %d steady-state passes\n", name, n, PASSES - 2);
+        failures++;
+    }
+
+    if (failures == 0)
+        std::printf("ok %s\n", name);
+    return failures;
+}
+
+// INC / GET with keys past the std::string SSO limit, about half of them owned by the other loop
+static std::string forwarded_batch() {
+    std::string batch;
+    for (int i = 0; i < KEYS; i++) {
+        std::string key = "forwarded-counter-" + std::to_string(i);
+        batch += "INC " + key + " 1\nGET " + key + "\n";
+    }
+    return batch;
+}
+
+// Reads the 2 * KEYS reply lines of one pass from the client end of the socket pair.
+static bool read_replies(int fd, char *buf, size_t size) {
+    size_t got = 0;
+    long lines = 0;
+    while (lines < 2 * KEYS) {
+        ssize_t n = recv(fd, buf + got, size - got, MSG_DONTWAIT);
+        if (n <= 0)
+            return false;
+        lines += std::count(buf + got, buf + got + n, '\n');
+        got += n;
+    }
+    return lines == 2 * KEYS && std::search(buf, buf + got, "ERR", "ERR" + 3) == buf + got;
+}
+
+static int check_shared_nothing() {
+    Settings settings;
+    settings.port = 0;
+    settings.verbose = false;
+    settings.shared_nothing = true;
+    settings.num_threads = 2;
+    Server server(settings);
+    int failures = 0;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        std::printf("FAIL shared-nothing: socketpair\n");
+        return 1;
+    }
+    Connection conn;
+    conn.fd = sv[0];
+    ServerProbe::attach(server, conn);
+
+    std::string batch = forwarded_batch();
+    static char replies[64 * 1024];
+    bool ok = true;
+    long before = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        if (pass == 2) {
+            before = allocations;
+            counting = true;
+        }
+        conn.inbuf.append(batch.data(), batch.size());
+        if (!ServerProbe::exchange(server, conn) || !read_replies(sv[1], replies, sizeof(replies)))
+            ok = false;
+    }
+    counting = false;
+    long n = allocations - before;
+
+    int remote = 0;
+    for (int i = 0; i < KEYS; i++)
+        remote += ServerProbe::owner(server, "forwarded-counter-" + std::to_string(i)) != 0;
+    if (remote == 0) {
+        std::printf("FAIL shared-nothing: no key is owned by the other loop\n");
+        failures++;
+    }
+    std::string get = "GET forwarded-counter-0\n";
+    conn.inbuf.append(get.data(), get.size());
+    std::string expect = "VALUE " + std::to_string(PASSES) + "\n";
+    ssize_t got = ServerProbe::exchange(server, conn) ? recv(sv[1], replies, sizeof(replies), MSG_DONTWAIT) : -1;
+    if (got < 0 || std::string(replies, got) != expect) {
+        std::printf("FAIL shared-nothing: expected %s", expect.c_str());
+        failures++;
+    }
+    if (!ok) {
+        std::printf("FAIL shared-nothing: wrong replies\n");
+        failures++;
+    }
+    if (n != 0) {
+        std::printf("FAIL shared-nothing: %ld allocations in %d steady-state passes\n", n, PASSES - 2);
+        failures++;
+    }
+    close(sv[0]);
+    close(sv[1]);
+    if (failures == 0)
+        std::printf("ok shared-nothing\n");
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    // an idle connection holds no input slab
+    counting = true;
+    long before = allocations;
+    {
+        InputBuffer idle;
+        if (idle.allocated() || allocations != before) {
+            std::printf("FAIL InputBuffer allocates before the first recv\n");
+            failures++;
+        }
+    }
+    counting = false;
+    InputBuffer buf;
+    buf.append("x", 1);
+    buf.consume(1);
+    buf.release();
+    if (buf.allocated()) {
+        std::printf("FAIL InputBuffer keeps an empty slab after release()\n");
+        failures++;
+    }
+
+    Settings plain;
+    failures += check("default", plain);
+    Settings combining;
+    combining.combine_keys = 256;
+    failures += check("--combine 256", combining);
+    failures += check_shared_nothing();
+    return failures == 0 ? 0 : 1;
+}